@@ -675,6 +675,22 @@ struct ggml_backend_sched_split {
     struct ggml_cgraph graph;
 };
 
+// what the backend assignment of a tensor depends on
+// graphs that are rebuilt for every evaluation (e.g. one decoder step per token) usually come back
+// with the same tensors in the same order, so the previous assignment can be reused as is
+struct ggml_backend_sched_topo {
+    struct ggml_tensor * tensor;
+    struct ggml_tensor * src[GGML_MAX_SRC];
+    struct ggml_tensor * view_src;
+    ggml_backend_buffer_type_t buft; // buffer type of the pre-allocated data, if any
+    enum ggml_op   op;
+    enum ggml_type type;
+    int32_t  flags;
+    bool     weights;
+    uint64_t shape; // hash of the shape and op params, only used with multiple backends
+    int      backend_id;
+};
+
 struct ggml_backend_sched {
     bool is_reset; // true if the scheduler has been reset since the last graph split
     bool is_alloc;
@@ -722,6 +738,15 @@ struct ggml_backend_sched {
 
     bool op_offload;
 
+    // topology of the last graph that was fully split, in the order it was received
+    struct ggml_backend_sched_topo * topo_nodes;
+    struct ggml_backend_sched_topo * topo_leafs;
+    int  topo_n_nodes;
+    int  topo_n_leafs;
+    int  topo_size;
+    bool topo_valid;
+    bool topo_reused; // the current splits come from the saved topology and the hash set is empty
+
     int debug;
 };
 
@@ -908,12 +933,175 @@ static void ggml_backend_sched_set_if_supported(ggml_backend_sched_t sched, stru
     }
 }
 
+static void ggml_backend_sched_topo_init(ggml_backend_sched_t sched, struct ggml_backend_sched_topo * topo, struct ggml_tensor * tensor) {
+    ggml_backend_buffer_t buffer = tensor->view_src ? tensor->view_src->buffer : tensor->buffer;
+
+    topo->tensor = tensor;
+    for (int j = 0; j < GGML_MAX_SRC; j++) {
+        topo->src[j] = tensor->src[j];
+    }
+    topo->view_src = tensor->view_src;
+    topo->buft    = buffer ? buffer->buft : NULL;
+    topo->op      = tensor->op;
+    topo->type    = tensor->type;
+    topo->flags   = tensor->flags;
+    topo->weights = tensor->buffer != NULL && tensor->buffer->usage == GGML_BACKEND_BUFFER_USAGE_WEIGHTS;
+    topo->shape   = 0;
+
+    // with a single backend the assignment cannot depend on the shapes
+    // with several, supports_op and offload_op may look at them
+    if (sched->n_backends > 1) {
+        uint64_t h = 14695981039346656037ULL;
+        const uint8_t * data[3] = { (const uint8_t *) tensor->ne, (const uint8_t *) tensor->nb, (const uint8_t *) tensor->op_params };
+        const size_t    size[3] = { sizeof(tensor->ne), sizeof(tensor->nb), sizeof(tensor->op_params) };
+        for (int k = 0; k < 3; k++) {
+            for (size_t i = 0; i < size[k]; i++) {
+                h = (h ^ data[k][i])*1099511628211ULL;
+            }
+        }
+        topo->shape = h;
+    }
+}
+
+static bool ggml_backend_sched_topo_equal(const struct ggml_backend_sched_topo * a, const struct ggml_backend_sched_topo * b) {
+    if (a->tensor != b->tensor || a->view_src != b->view_src || a->buft != b->buft || a->op != b->op ||
+        a->type != b->type || a->flags != b->flags || a->weights != b->weights || a->shape != b->shape) {
+        return false;
+    }
+    for (int j = 0; j < GGML_MAX_SRC; j++) {
+        if (a->src[j] != b->src[j]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// check if the graph has the same topology as the last graph that was fully split
+static bool ggml_backend_sched_topo_match(ggml_backend_sched_t sched, struct ggml_cgraph * graph) {
+    if (!sched->topo_valid || graph->n_nodes != sched->topo_n_nodes || graph->n_leafs != sched->topo_n_leafs) {
+        return false;
+    }
+
+    struct ggml_backend_sched_topo topo;
+    for (int i = 0; i < graph->n_nodes; i++) {
+        ggml_backend_sched_topo_init(sched, &topo, graph->nodes[i]);
+        if (!ggml_backend_sched_topo_equal(&topo, &sched->topo_nodes[i])) {
+            return false;
+        }
+    }
+    for (int i = 0; i < graph->n_leafs; i++) {
+        ggml_backend_sched_topo_init(sched, &topo, graph->leafs[i]);
+        if (!ggml_backend_sched_topo_equal(&topo, &sched->topo_leafs[i])) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// save the topology and the assignments of a graph that has just been split
+// graphs with copies between backends are not saved, since the copies rewrite the sources of the nodes
+static void ggml_backend_sched_topo_save(ggml_backend_sched_t sched, struct ggml_cgraph * graph) {
+    sched->topo_valid = false;
+
+    if (sched->n_copies > 1 || sched->n_graph_inputs > 0 || sched->debug) {
+        return;
+    }
+
+    for (int i = 0; i < sched->n_splits; i++) {
+        const struct ggml_backend_sched_split * split = &sched->splits[i];
+        if (split->n_inputs > 0) {
+            return;
+        }
+        // the backend may reorder the nodes of the split, so all of them need the same assignment
+        if (sched->backends[split->backend_id]->iface.graph_optimize != NULL) {
+            for (int j = split->i_start; j < split->i_end; j++) {
+                if (tensor_backend_id(graph->nodes[j]) != split->backend_id) {
+                    return;
+                }
+            }
+        }
+    }
+
+    const int size = std::max(graph->n_nodes, graph->n_leafs);
+    if (sched->topo_size < size) {
+        sched->topo_size = size;
+        sched->topo_nodes = (ggml_backend_sched_topo *) realloc(sched->topo_nodes, size * sizeof(struct ggml_backend_sched_topo));
+        sched->topo_leafs = (ggml_backend_sched_topo *) realloc(sched->topo_leafs, size * sizeof(struct ggml_backend_sched_topo));
+        GGML_ASSERT(sched->topo_nodes != NULL);
+        GGML_ASSERT(sched->topo_leafs != NULL);
+    }
+
+    for (int i = 0; i < graph->n_nodes; i++) {
+        ggml_backend_sched_topo_init(sched, &sched->topo_nodes[i], graph->nodes[i]);
+        sched->topo_nodes[i].backend_id = tensor_backend_id(graph->nodes[i]);
+    }
+    for (int i = 0; i < graph->n_leafs; i++) {
+        ggml_backend_sched_topo_init(sched, &sched->topo_leafs[i], graph->leafs[i]);
+        sched->topo_leafs[i].backend_id = tensor_backend_id(graph->leafs[i]);
+    }
+
+    sched->topo_n_nodes = graph->n_nodes;
+    sched->topo_n_leafs = graph->n_leafs;
+    sched->topo_valid   = true;
+}
+
+// split a graph with the same topology as the saved one
+// the splits (backend and node range) are kept, only the views of the new graph and the graph copy are rebuilt
+static void ggml_backend_sched_split_graph_reuse(ggml_backend_sched_t sched, struct ggml_cgraph * graph) {
+    sched->topo_reused = true;
+
+    {
+        int * tmp = sched->node_backend_ids;
+        sched->node_backend_ids = sched->prev_node_backend_ids;
+        sched->prev_node_backend_ids = tmp;
+
+        tmp = sched->leaf_backend_ids;
+        sched->leaf_backend_ids = sched->prev_leaf_backend_ids;
+        sched->prev_leaf_backend_ids = tmp;
+    }
+
+    struct ggml_cgraph * graph_copy = &sched->graph;
+
+    graph_copy->n_nodes = 0;
+    graph_copy->n_leafs = 0;
+
+    for (int i = 0; i < sched->n_splits; i++) {
+        struct ggml_backend_sched_split * split = &sched->splits[i];
+        split->graph = ggml_graph_view(graph, split->i_start, split->i_end);
+
+        ggml_backend_t backend = sched->backends[split->backend_id];
+        ggml_backend_graph_optimize(backend, &split->graph);
+
+        // if the backend reordered the nodes, they all have the backend of the split (see ggml_backend_sched_topo_save)
+        const bool reordered = backend->iface.graph_optimize != NULL;
+
+        for (int j = split->i_start; j < split->i_end; j++) {
+            sched->node_backend_ids[graph_copy->n_nodes] = reordered ? split->backend_id : sched->topo_nodes[j].backend_id;
+            graph_copy->nodes[graph_copy->n_nodes++] = graph->nodes[j];
+        }
+    }
+
+    for (int i = 0; i < graph->n_leafs; i++) {
+        sched->leaf_backend_ids[graph_copy->n_leafs] = sched->topo_leafs[i].backend_id;
+        graph_copy->leafs[graph_copy->n_leafs++] = graph->leafs[i];
+    }
+}
+
 // assigns backends to ops and splits the graph into subgraphs that can be computed on the same backend
 void ggml_backend_sched_split_graph(ggml_backend_sched_t sched, struct ggml_cgraph * graph) {
+    // a graph with the same topology as the previous one gets the same assignments and splits
+    // user assignments live in the hash set, so a scheduler that has not been reset always goes through the full split
+    if (sched->is_reset && ggml_backend_sched_topo_match(sched, graph)) {
+        ggml_backend_sched_split_graph_reuse(sched, graph);
+        return;
+    }
+
     // reset splits
     sched->n_splits = 0;
     sched->n_graph_inputs = 0;
     sched->is_reset = false;
+    sched->topo_reused = false;
 
     struct ggml_init_params params = {
         /* .mem_size =   */ sched->context_buffer_size,
@@ -1277,6 +1465,8 @@ void ggml_backend_sched_split_graph(ggml_backend_sched_t sched, struct ggml_cgra
         ggml_backend_sched_print_assignments(sched, graph);
     }
 
+    ggml_backend_sched_topo_save(sched, graph);
+
     // swap node_backend_ids and leaf _backend_ids with prevs
     {
         int * tmp = sched->node_backend_ids;
@@ -1679,6 +1869,8 @@ void ggml_backend_sched_free(ggml_backend_sched_t sched) {
     free(sched->context_buffer);
     free(sched->graph.nodes);
     free(sched->graph.leafs);
+    free(sched->topo_nodes);
+    free(sched->topo_leafs);
     free(sched);
 }
 
@@ -1819,6 +2011,19 @@ void ggml_backend_sched_set_tensor_backend(ggml_backend_sched_t sched, struct gg
 ggml_backend_t ggml_backend_sched_get_tensor_backend(ggml_backend_sched_t sched, struct ggml_tensor * node) {
     GGML_ASSERT(sched);
     int backend_index = tensor_backend_id(node);
+    if (backend_index == -1 && sched->topo_reused) {
+        // the graph was split from the saved topology without filling the hash set
+        for (int i = 0; i < sched->topo_n_nodes && backend_index == -1; i++) {
+            if (sched->topo_nodes[i].tensor == node) {
+                backend_index = sched->topo_nodes[i].backend_id;
+            }
+        }
+        for (int i = 0; i < sched->topo_n_leafs && backend_index == -1; i++) {
+            if (sched->topo_leafs[i].tensor == node) {
+                backend_index = sched->topo_leafs[i].backend_id;
+            }
+        }
+    }
     if (backend_index == -1) {
         return NULL;
     }
@@ -23,18 +23,21 @@
 #include <algorithm>
 #include <cassert>
 #include <cfloat>
+#include <chrono>
+#include <condition_variable>
 #define _USE_MATH_DEFINES
 #include <cmath>
 #include <climits>
 #include <cstdarg>
 #include <cstdio>
 #include <cstring>
+#include <deque>
 #include <fstream>
 #include <functional>
 #include <map>
+#include <mutex>
 #include <random>
 #include <regex>
-#include <set>
 #include <string>
 #include <thread>
 #include <vector>
@@ -43,6 +46,14 @@
 #include <codecvt>
 #endif
 
+#ifndef _WIN32
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 #if defined(WHISPER_BIG_ENDIAN)
 template<typename T>
 static T byteswap(T value) {
@@ -74,6 +85,10 @@ static void byteswap_tensor(ggml_tensor * tensor) {
             byteswap_tensor_data<ggml_fp16_t>(tensor);
             break;
         }
+        case GGML_TYPE_BF16: {
+            byteswap_tensor_data<ggml_bf16_t>(tensor);
+            break;
+        }
         case GGML_TYPE_I32: {
             byteswap_tensor_data<int32_t>(tensor);
             break;
@@ -151,6 +166,16 @@ static constexpr float WHISPER_HISTORY_CONDITIONING_TEMP_CUTOFF = 0.5f;
 
 #define WHISPER_MAX_NODES 4096
 
+// layers whose weights are paged in ahead of the graph in low-memory mode (see whisper_stream_eval)
+#define WHISPER_STREAM_AHEAD 2
+
+// conv stem cache of streams (see whisper_conv_cache_reuse)
+#define WHISPER_CONV_CACHE_HEAD 2  // columns that are always computed at the start of a window
+#define WHISPER_CONV_CACHE_MIN  16 // fewest columns worth reusing
+
+// default size of the state pool of whisper_full_batch, every state has its own KV caches and compute buffer
+#define WHISPER_BATCH_N_STATES 2
+
 static std::string format(const char * fmt, ...) {
     va_list ap;
     va_list ap2;
@@ -440,6 +465,9 @@ struct whisper_vocab {
     std::map<token, id> token_to_id;
     std::map<id, token> id_to_token;
 
+    // voice_length() of every token, used by the token-level timestamps
+    std::vector<float> token_vlen;
+
     // reference: https://github.com/openai/whisper/blob/248b6cb124225dd263bb9bd32d060b6517e067f8/whisper/tokenizer.py#L334-L349
     id token_eot        = 50256;
     id token_sot        = 50257;
@@ -577,6 +605,20 @@ static bool whisper_sched_graph_init(struct whisper_sched & allocr, std::vector<
     return true;
 }
 
+// reserve the compute buffer of a scheduler that is shared by several graphs
+// the buffer grows to the largest of the reserved graphs, so the graphs must not be alive at the same time
+static bool whisper_sched_graph_reserve(ggml_backend_sched_t sched, std::vector<uint8_t> & meta, std::function<struct ggml_cgraph *()> && get_graph) {
+    meta.resize(ggml_tensor_overhead()*WHISPER_MAX_NODES + ggml_graph_overhead());
+
+    if (!ggml_backend_sched_reserve(sched, get_graph())) {
+        // failed to allocate the compute buffer
+        WHISPER_LOG_ERROR("%s: failed to allocate the compute buffer\n", __func__);
+        return false;
+    }
+
+    return true;
+}
+
 // medium
 // hparams: {
 // 'n_mels': 80,
@@ -697,13 +739,17 @@ struct whisper_layer_decoder {
 struct whisper_kv_cell {
     whisper_pos pos = -1;
 
-    std::set<whisper_seq_id> seq_id;
+    // bit i is set if the cell belongs to sequence i - a bitmask instead of a std::set, so that the decode loop
+    // does not allocate. the beam search uses the sequence ids [0, 2*WHISPER_MAX_DECODERS)
+    uint32_t seq_mask = 0;
 
     bool has_seq_id(const whisper_seq_id & id) const {
-        return seq_id.find(id) != seq_id.end();
+        return (seq_mask >> id) & 1u;
     }
 };
 
+static_assert(2*WHISPER_MAX_DECODERS <= 32, "whisper_kv_cell::seq_mask is too small");
+
 struct whisper_kv_cache {
     uint32_t head = 0;
     uint32_t size = 0;
@@ -752,9 +798,22 @@ struct whisper_model {
     struct ggml_tensor * d_ln_w;
     struct ggml_tensor * d_ln_b;
 
+    // rows of d_te for the vocabulary shortlist, in the order of shortlist (see whisper_set_vocab_shortlist)
+    struct ggml_tensor *       d_te_short   = nullptr;
+    ggml_context *             ctx_short    = nullptr;
+    ggml_backend_buffer_t      buffer_short = nullptr;
+    std::vector<whisper_token> shortlist;
+
     std::vector<whisper_layer_encoder> layers_encoder;
     std::vector<whisper_layer_decoder> layers_decoder;
 
+    // low-memory mode: the matrices of the layers point into the mapping of the model file
+    // a slot is an encoder layer or, after them, a decoder layer
+    struct whisper_mmap *                  mapping       = nullptr;
+    ggml_backend_buffer_t                  buffer_mapped = nullptr;
+    std::map<const ggml_tensor *, int>     stream_slot;  // slot of each mapped weight
+    std::vector<std::pair<size_t, size_t>> stream_pages; // page-aligned [begin, end) of the file used by each slot
+
     // ggml context that contains all the meta information about the model tensors
     std::vector<ggml_context *> ctxs;
 
@@ -818,8 +877,14 @@ struct whisper_decoder {
     std::vector<float> logits;
     std::vector<float> logprobs;
 
-    // work container used to avoid memory allocations
+    // nodes of the hotword trie for the parts of hotwords that end the sequence, the roots are implied
+    std::vector<int32_t> hotword_prefixes;
+
+    // work containers used to avoid memory allocations
     std::vector<whisper_pair<double, whisper_vocab::id>> logits_id;
+    std::vector<whisper_token>                           hotword_tokens;
+    std::vector<whisper_token_data> tokens_topk;
+    mutable std::vector<double>     probs_cdf;
 
     mutable std::mt19937 rng; // used for sampling at t > 0.0
 };
@@ -836,6 +901,43 @@ struct vad_time_mapping {
     int64_t original_time;   // Corresponding time in original audio
 };
 
+// trie of the tokens of params.hotwords (see whisper_prepare_hotwords)
+// node 0 is the root of the phrases with a leading space, node 1 the root of the phrases without one
+// the children of a node are its edges [edge_begin, edge_end), sorted by token
+struct whisper_hotword_node {
+    int32_t edge_begin;
+    int32_t edge_end;
+};
+
+struct whisper_hotword_edge {
+    whisper_token token;
+    int32_t       node;
+};
+
+// CPU-side sub-phases of the decode loop, timed outside of the graph compute
+enum whisper_hot_phase {
+    WHISPER_HOT_LOGITS,  // logit filtering (incl. grammar)
+    WHISPER_HOT_SOFTMAX, // log-softmax and softmax over the vocabulary
+    WHISPER_HOT_SAMPLE,  // token selection
+    WHISPER_HOT_BEAM,    // beam candidates, merge and decoder copies
+    WHISPER_HOT_KV,      // KV cache bookkeeping
+    WHISPER_HOT_SEGMENT, // segment and timestamp extraction
+    WHISPER_HOT_COUNT,
+};
+
+struct whisper_hot_counter {
+    std::atomic<int64_t> t_us{0};
+    std::atomic<int32_t> n{0};
+};
+
+// low-memory mode: where the graph that is being computed is, see whisper_stream_eval
+struct whisper_stream {
+    const whisper_model * model = nullptr;
+
+    int slot_cur  = -1; // layer of the last weight seen by the scheduler
+    int slot_done = -1; // encoder layer to release once the current chunk of the graph has been computed
+};
+
 struct whisper_state {
     int64_t t_sample_us = 0;
     int64_t t_encode_us = 0;
@@ -852,6 +954,9 @@ struct whisper_state {
     int32_t n_fail_p = 0; // number of logprob threshold failures
     int32_t n_fail_h = 0; // number of entropy threshold failures
 
+    // sampling runs on several threads, so these are summed over all threads
+    whisper_hot_counter hot[WHISPER_HOT_COUNT];
+
     // number of decoders for which we have constructed the KV cache
     int32_t kv_self_n_dec = 0;
 
@@ -873,23 +978,69 @@ struct whisper_state {
 
     std::vector<ggml_backend_t> backends;
 
+    // persistent CPU threadpool shared by all graphs of the state (whisper_full_params.poll >= 0)
+    ggml_threadpool_t threadpool = nullptr;
+    int32_t threadpool_n_threads = 0;
+    int32_t threadpool_poll      = -1;
+
+    // single scheduler for the conv, encode, cross and decode graphs
+    // the graphs never run at the same time, so they share one compute buffer sized to the largest of them
+    ggml_backend_sched_t sched = nullptr;
+
+    // eval callback state of the scheduler in low-memory mode
+    whisper_stream stream;
+
     // - stores meta info about the intermediate tensors into the `meta` buffers
-    whisper_sched sched_conv;
-    whisper_sched sched_encode;
-    whisper_sched sched_cross;
-    whisper_sched sched_decode;
+    std::vector<uint8_t> meta_conv;
+    std::vector<uint8_t> meta_encode;
+    std::vector<uint8_t> meta_cross;
+    std::vector<uint8_t> meta_decode;
 
     // result of the encoder
+    // kept outside of the compute buffer, since it is reused by the graph that consumes them
     struct ggml_tensor * embd_conv = nullptr;
     struct ggml_tensor * embd_enc  = nullptr;
 
+    // embd_conv already holds the positional embedding, otherwise the encoder graph adds it
+    bool embd_conv_pe = false;
+
+    // absolute mel frame of the first frame of the spectrogram in a stream, -1 if unknown
+    int64_t mel_frame0 = -1;
+
+    // conv stem output and mel window of the last encoded window of a stream (see whisper_conv_cache_reuse)
+    struct {
+        int64_t            frame = -1; // absolute mel frame of the window
+        int                n_ctx = 0;
+        std::vector<float> mel;        // [n_mels][2*n_ctx]
+        std::vector<float> embd;       // [n_ctx][n_state], without the positional embedding
+    } conv_cache;
+
+    std::vector<uint8_t>  embd_ctx_buf;
+    ggml_backend_buffer_t embd_buffer = nullptr;
+
     // helpers for GPU offloading
     std::vector<float> inp_mel;
     std::vector<float> inp_mask;
 
+    // host buffer over mel.data, so that the conv graph reads the windows in place (see whisper_state_bind_mel)
+    ggml_backend_buffer_t mel_buffer      = nullptr;
+    const float *         mel_buffer_data = nullptr;
+    size_t                mel_buffer_size = 0;
+
+    // positions and sequences of the KV cells, used to build the KQ mask
+    std::vector<whisper_pos> inp_mask_pos;
+    std::vector<uint32_t>    inp_mask_seq;
+
     // decode output (2-dimensional array: [n_tokens][n_vocab])
     std::vector<float> logits;
 
+    // decode with the vocabulary shortlist, set by whisper_full
+    bool  vocab_shortlist               = false;
+    float vocab_shortlist_logprob_thold = 0.0f;
+
+    std::vector<float> logits_short; // [n_outputs][n_shortlist]
+    std::vector<float> hidden;       // decoder output of the tokens that fall back to the full vocabulary
+
     std::vector<whisper_segment> result_all;
 
     // prompt history split into static prefix (prompt_past0) and dynamic rolling context (prompt_past1)
@@ -914,7 +1065,17 @@ struct whisper_state {
 
     whisper_token tid_last;
 
-    std::vector<float> energy; // PCM signal energy
+    // PCM signal energy, only computed over the samples the timestamps of the current segment look at
+    // the sums start at energy_b0 and are rebased when a lookup leaves the window, see whisper_energy_extend()
+    //   energy_sum [i] = sum of |pcm[k]|    for max(energy_b0 - hw, 0) <= k < max(energy_b0 - hw, 0) + i
+    //   energy_sum2[i] = sum of energy[k]   for energy_b0 <= k < energy_b0 + i
+    const float * energy_pcm   = nullptr; // samples of the current whisper_full call
+    int           energy_n_pcm = 0;
+    int           energy_b0    = 0;
+
+    std::vector<double> energy_sum;
+    std::vector<double> energy_sum2;
+
     float no_speech_prob = 0.0f;
 
     // [EXPERIMENTAL] Token-level timestamps with DTW
@@ -925,6 +1086,27 @@ struct whisper_state {
     // [EXPERIMENTAL] speed-up techniques
     int32_t exp_n_audio_ctx = 0; // 0 - use default
 
+    // tokens suppressed by params.suppress_regex and params.suppress_nst
+    // resolved once instead of matching the vocabulary for every sampled token
+    bool                       suppress_ready = false;
+    std::string                suppress_regex;
+    bool                       suppress_nst   = false;
+    std::vector<whisper_token> suppress_ids;
+
+    // params.hotwords compiled into a trie, rebuilt only when the hotwords change
+    std::vector<std::string>          hotwords;
+    std::vector<whisper_hotword_node> hotword_nodes;
+    std::vector<whisper_hotword_edge> hotword_edges;
+
+    // sorted first tokens of the phrases: with a leading space, and with or without one (start of the text)
+    std::vector<whisper_token> hotword_roots;
+    std::vector<whisper_token> hotword_roots_start;
+
+    // heap allocations made by the token loop and the number of its iterations
+    // the allocations are counted only when built with WHISPER_ALLOC_TRACKING
+    int64_t n_alloc_decode = 0;
+    int32_t n_decode_steps = 0;
+
     whisper_vad_context * vad_context = nullptr;
 
     struct vad_segment_info {
@@ -943,8 +1125,8 @@ struct whisper_context {
     int64_t t_load_us  = 0;
     int64_t t_start_us = 0;
 
-    ggml_type wtype = ggml_type::GGML_TYPE_F16; // weight type (FP32 / FP16 / QX)
-    ggml_type itype = ggml_type::GGML_TYPE_F16; // intermediate type (FP32 or FP16)
+    ggml_type wtype = ggml_type::GGML_TYPE_F16; // weight type (FP32 / FP16 / BF16 / QX)
+    ggml_type itype = ggml_type::GGML_TYPE_F16; // intermediate type (FP32, FP16 or BF16), see whisper_context_params.type_kv
 
     whisper_context_params params;
 
@@ -964,6 +1146,110 @@ struct whisper_global {
 
 static whisper_global g_state;
 
+// debug / bench builds can count the C++ heap allocations of the process by defining WHISPER_ALLOC_TRACKING
+// note that this replaces the global operator new / delete of the whole application
+#ifdef WHISPER_ALLOC_TRACKING
+#include <new>
+
+static std::atomic<int64_t> g_n_alloc{0};
+
+void * operator new(size_t size) {
+    g_n_alloc.fetch_add(1, std::memory_order_relaxed);
+    if (void * ptr = malloc(size ? size : 1)) {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+void * operator new[](size_t size) {
+    return ::operator new(size);
+}
+
+void operator delete  (void * ptr) noexcept         { free(ptr); }
+void operator delete[](void * ptr) noexcept         { free(ptr); }
+void operator delete  (void * ptr, size_t) noexcept { free(ptr); }
+void operator delete[](void * ptr, size_t) noexcept { free(ptr); }
+
+static int64_t whisper_alloc_count() {
+    return g_n_alloc.load(std::memory_order_relaxed);
+}
+#else
+static int64_t whisper_alloc_count() {
+    return 0;
+}
+#endif
+
+typedef ggml_threadpool_t (*whisper_threadpool_new_t) (struct ggml_threadpool_params * params);
+typedef void              (*whisper_threadpool_free_t)(ggml_threadpool_t threadpool);
+typedef void              (*whisper_set_threadpool_t) (ggml_backend_t backend, ggml_threadpool_t threadpool);
+
+// attach a persistent threadpool of n_threads with the given polling level to the CPU backends of the state
+// poll < 0 detaches it, in which case the CPU backend creates a new threadpool for every graph
+static void whisper_state_set_threadpool(whisper_state & state, int n_threads, int poll) {
+    if (poll < 0 && state.threadpool == nullptr) {
+        return;
+    }
+
+    if (poll >= 0 && state.threadpool != nullptr && state.threadpool_n_threads == n_threads && state.threadpool_poll == poll) {
+        return;
+    }
+
+    ggml_backend_dev_t dev_cpu = ggml_backend_dev_by_type(GGML_BACKEND_DEVICE_TYPE_CPU);
+    ggml_backend_reg_t reg_cpu = dev_cpu ? ggml_backend_dev_backend_reg(dev_cpu) : nullptr;
+    if (reg_cpu == nullptr) {
+        return;
+    }
+
+    auto * fn_new  = (whisper_threadpool_new_t)  ggml_backend_reg_get_proc_address(reg_cpu, "ggml_threadpool_new");
+    auto * fn_free = (whisper_threadpool_free_t) ggml_backend_reg_get_proc_address(reg_cpu, "ggml_threadpool_free");
+    auto * fn_set  = (whisper_set_threadpool_t)  ggml_backend_reg_get_proc_address(reg_cpu, "ggml_backend_cpu_set_threadpool");
+    if (!fn_new || !fn_free || !fn_set) {
+        return;
+    }
+
+    ggml_threadpool_t threadpool = nullptr;
+    if (poll >= 0) {
+        struct ggml_threadpool_params tpp = ggml_threadpool_params_default(n_threads);
+        tpp.poll = std::min(poll, 100);
+
+        threadpool = fn_new(&tpp);
+        if (threadpool == nullptr) {
+            WHISPER_LOG_WARN("%s: failed to create threadpool (n_threads = %d, poll = %d)\n", __func__, n_threads, poll);
+        }
+    }
+
+    for (auto * backend : state.backends) {
+        ggml_backend_dev_t dev = ggml_backend_get_device(backend);
+        if (dev && ggml_backend_dev_backend_reg(dev) == reg_cpu) {
+            fn_set(backend, threadpool);
+        }
+    }
+
+    if (state.threadpool != nullptr) {
+        fn_free(state.threadpool);
+    }
+
+    state.threadpool           = threadpool;
+    state.threadpool_n_threads = threadpool ? n_threads : 0;
+    state.threadpool_poll      = threadpool ? poll      : -1;
+}
+
+static void whisper_hot_add(whisper_state & state, whisper_hot_phase phase, int64_t t_us) {
+    state.hot[phase].t_us += t_us;
+    state.hot[phase].n    += 1;
+}
+
+struct whisper_hot_timer {
+    whisper_state &   state;
+    whisper_hot_phase phase;
+    int64_t           t_start_us;
+
+    whisper_hot_timer(whisper_state & state, whisper_hot_phase phase) : state(state), phase(phase), t_start_us(ggml_time_us()) {}
+    ~whisper_hot_timer() {
+        whisper_hot_add(state, phase, ggml_time_us() - t_start_us);
+    }
+};
+
 template<typename T>
 static void read_safe(whisper_model_loader * loader, T & dest) {
     loader->read(loader->context, &dest, sizeof(T));
@@ -1065,7 +1351,8 @@ static bool whisper_kv_cache_find_slot(
         cache.cells[cache.head + i].pos = batch.pos[i];
 
         for (int32_t j = 0; j < batch.n_seq_id[i]; j++) {
-            cache.cells[cache.head + i].seq_id.insert(batch.seq_id[i][j]);
+            GGML_ASSERT(batch.seq_id[i][j] >= 0 && batch.seq_id[i][j] < 32);
+            cache.cells[cache.head + i].seq_mask |= 1u << batch.seq_id[i][j];
         }
     }
 
@@ -1075,7 +1362,7 @@ static bool whisper_kv_cache_find_slot(
 // find how many cells are currently in use
 static int32_t whisper_kv_cache_cell_max(const struct whisper_kv_cache & cache) {
     for (uint32_t i = cache.size - 1; i > 0; --i) {
-        if (cache.cells[i].pos >= 0 && !cache.cells[i].seq_id.empty()) {
+        if (cache.cells[i].pos >= 0 && cache.cells[i].seq_mask != 0) {
             return i + 1;
         }
     }
@@ -1086,7 +1373,7 @@ static int32_t whisper_kv_cache_cell_max(const struct whisper_kv_cache & cache)
 static void whisper_kv_cache_clear(struct whisper_kv_cache & cache) {
     for (int32_t i = 0; i < (int32_t) cache.size; ++i) {
         cache.cells[i].pos = -1;
-        cache.cells[i].seq_id.clear();
+        cache.cells[i].seq_mask = 0;
     }
     cache.head = 0;
 
@@ -1106,13 +1393,13 @@ static void whisper_kv_cache_seq_rm(
     for (uint32_t i = 0; i < cache.size; ++i) {
         if (cache.cells[i].pos >= p0 && cache.cells[i].pos < p1) {
             if (seq_id < 0) {
-                cache.cells[i].seq_id.clear();
+                cache.cells[i].seq_mask = 0;
             } else if (cache.cells[i].has_seq_id(seq_id)) {
-                cache.cells[i].seq_id.erase(seq_id);
+                cache.cells[i].seq_mask &= ~(1u << seq_id);
             } else {
                 continue;
             }
-            if (cache.cells[i].seq_id.empty()) {
+            if (cache.cells[i].seq_mask == 0) {
                 cache.cells[i].pos = -1;
                 if (new_head == cache.size) new_head = i;
             }
@@ -1136,7 +1423,7 @@ static void whisper_kv_cache_seq_cp(
 
     for (uint32_t i = 0; i < cache.size; ++i) {
         if (cache.cells[i].has_seq_id(seq_id_src) && cache.cells[i].pos >= p0 && cache.cells[i].pos < p1) {
-            cache.cells[i].seq_id.insert(seq_id_dst);
+            cache.cells[i].seq_mask |= 1u << seq_id_dst;
         }
     }
 }
@@ -1476,6 +1763,97 @@ static ggml_backend_buffer_type_t select_weight_buft(const whisper_hparams & hpa
     return nullptr;
 }
 
+// a cost-function / heuristic that is high for text that takes longer to pronounce
+// obviously, can be improved
+static float voice_length(const std::string & text) {
+    float res = 0.0f;
+
+    for (char c : text) {
+        if (c == ' ') {
+            res += 0.01f;
+        } else if (c == ',') {
+            res += 2.00f;
+        } else if (c == '.') {
+            res += 3.00f;
+        } else if (c == '!') {
+            res += 3.00f;
+        } else if (c == '?') {
+            res += 3.00f;
+        } else if (c >= '0' && c <= '9') {
+            res += 3.00f;
+        } else {
+            res += 1.00f;
+        }
+    }
+
+    return res;
+}
+
+// read-only mapping of a model file, used by the low-memory mode
+struct whisper_mmap {
+    void * addr   = nullptr;
+    size_t size   = 0;
+    size_t offset = 0; // read position of the loader
+};
+
+static size_t whisper_mmap_read(void * ctx, void * output, size_t read_size) {
+    whisper_mmap * mapping = (whisper_mmap *) ctx;
+
+    const size_t n = std::min(read_size, mapping->size - mapping->offset);
+
+    memcpy(output, (const char *) mapping->addr + mapping->offset, n);
+    mapping->offset += n;
+
+    return n;
+}
+
+static bool whisper_mmap_eof(void * ctx) {
+    const whisper_mmap * mapping = (const whisper_mmap *) ctx;
+
+    return mapping->offset >= mapping->size;
+}
+
+static void whisper_mmap_free(whisper_mmap * mapping) {
+    if (mapping == nullptr) {
+        return;
+    }
+#if !defined(_WIN32)
+    munmap(mapping->addr, mapping->size);
+#endif
+    delete mapping;
+}
+
+#if !defined(_WIN32)
+static whisper_mmap * whisper_mmap_init(const char * path) {
+    const int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        WHISPER_LOG_ERROR("%s: failed to open '%s'\n", __func__, path);
+        return nullptr;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        WHISPER_LOG_ERROR("%s: failed to get the size of '%s'\n", __func__, path);
+        close(fd);
+        return nullptr;
+    }
+
+    void * addr = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (addr == MAP_FAILED) {
+        WHISPER_LOG_ERROR("%s: failed to mmap '%s'\n", __func__, path);
+        return nullptr;
+    }
+
+    whisper_mmap * mapping = new whisper_mmap;
+    mapping->addr = addr;
+    mapping->size = st.st_size;
+
+    return mapping;
+}
+#endif
+
 // load the model from a ggml file
 //
 // file format:
@@ -1573,7 +1951,7 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
         WHISPER_LOG_INFO("%s: n_text_head   = %d\n", __func__, hparams.n_text_head);
         WHISPER_LOG_INFO("%s: n_text_layer  = %d\n", __func__, hparams.n_text_layer);
         WHISPER_LOG_INFO("%s: n_mels        = %d\n", __func__, hparams.n_mels);
-        WHISPER_LOG_INFO("%s: ftype         = %d\n", __func__, model.hparams.ftype);
+        WHISPER_LOG_INFO("%s: ftype         = %d (%s)\n", __func__, model.hparams.ftype, ggml_type_name(wctx.wtype));
         WHISPER_LOG_INFO("%s: qntvr         = %d\n", __func__, qntvr);
         WHISPER_LOG_INFO("%s: type          = %d (%s%s)\n", __func__, model.type, g_model_name.at(model.type).c_str(), mver.c_str());
     }
@@ -1676,11 +2054,16 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
             }
         }
 
+        vocab.token_vlen.resize(vocab.id_to_token.empty() ? 0 : vocab.id_to_token.rbegin()->first + 1, 0.0f);
+        for (const auto & kv : vocab.id_to_token) {
+            vocab.token_vlen[kv.first] = voice_length(kv.second.c_str());
+        }
+
         WHISPER_LOG_INFO("%s: n_langs       = %d\n", __func__, vocab.num_languages());
     }
 
     const ggml_type wtype = wctx.wtype;
-    const ggml_type vtype = wctx.wtype == GGML_TYPE_F32 ? GGML_TYPE_F32 : GGML_TYPE_F16; // conv type
+    const ggml_type vtype = wctx.wtype == GGML_TYPE_F32 ? GGML_TYPE_F32 : GGML_TYPE_F16; // conv type (im2col has no BF16 path)
 
     const auto & hparams = model.hparams;
 
@@ -1713,6 +2096,26 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
         return it->second;
     };
 
+    // low-memory mode: the file is mapped (see whisper_init_from_file_with_params_no_state) and the matrices of the
+    // layers are not allocated, they are bound to their data in the mapping when they are read
+    whisper_mmap * mapping    = loader->read == whisper_mmap_read ? (whisper_mmap *) loader->context : nullptr;
+    ggml_context * ctx_mapped = nullptr;
+
+    if (mapping) {
+        ggml_init_params params = {
+            /*.mem_size   =*/ n_tensors * ggml_tensor_overhead(),
+            /*.mem_buffer =*/ nullptr,
+            /*.no_alloc   =*/ true,
+        };
+
+        ctx_mapped = ggml_init(params);
+        if (!ctx_mapped) {
+            throw std::runtime_error("failed to create ggml context");
+        }
+
+        model.ctxs.emplace_back(ctx_mapped);
+    }
+
     // Create a list of available bufts, in priority order
     buft_list_t buft_list = make_buft_list(wctx.params);
 
@@ -1723,9 +2126,16 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
             throw std::runtime_error(format("failed to find a compatible buffer type for tensor %s", ASR_TENSOR_NAMES.at(system).at(type)));
         }
 
-        ggml_context * ctx = get_ctx(buft);
+        // only the layers have weights that are multiplied with
+        const bool mapped = mapping && op == GGML_OP_MUL_MAT && buft == ggml_backend_cpu_buffer_type();
+
+        ggml_context * ctx = mapped ? ctx_mapped : get_ctx(buft);
         ggml_tensor * tensor = ggml_dup_tensor(ctx, meta);
 
+        if (mapped) {
+            model.stream_slot[tensor] = system == ASR_SYSTEM_ENCODER ? layer : n_audio_layer + layer;
+        }
+
         model.tensors[format(ASR_TENSOR_NAMES.at(system).at(type), layer)] = tensor;
 
         return tensor;
@@ -1863,9 +2273,24 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
         }
     }
 
+    if (mapping) {
+        model.buffer_mapped = ggml_backend_cpu_buffer_from_ptr(mapping->addr, mapping->size);
+        model.buffers.emplace_back(model.buffer_mapped);
+
+        model.stream_pages.assign(n_audio_layer + n_text_layer, { SIZE_MAX, 0 });
+    }
+
     // load weights
     {
-        size_t total_size = 0;
+        size_t total_size  = 0;
+        size_t mapped_size = 0;
+        int    n_unaligned = 0;
+
+#if !defined(_WIN32)
+        const size_t page_size = sysconf(_SC_PAGESIZE);
+#else
+        const size_t page_size = 4096;
+#endif
 
         model.n_loaded = 0;
 
@@ -1924,7 +2349,52 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
                 return false;
             }
 
-            if (ggml_backend_buffer_is_host(tensor->buffer)) {
+            // F16 and BF16 have the same size, so the check above does not tell them apart
+            if (ttype != tensor->type && !(ttype == GGML_TYPE_BF16 && tensor->type == GGML_TYPE_F16)) {
+                WHISPER_LOG_ERROR("%s: tensor '%s' has wrong type in model file: got %s, expected %s\n",
+                        __func__, name.data(), ggml_type_name(ggml_type(ttype)), ggml_type_name(tensor->type));
+                return false;
+            }
+
+            if (ttype != tensor->type) {
+                // the conv weights of a BF16 model, the conv stem computes in F16
+                read_buf.resize(ggml_nbytes(tensor));
+
+                loader->read(loader->context, read_buf.data(), read_buf.size());
+
+                std::vector<float> tmp_f32(nelements);
+                ggml_bf16_to_fp32_row((const ggml_bf16_t *) read_buf.data(), tmp_f32.data(), nelements);
+                ggml_fp32_to_fp16_row(tmp_f32.data(), (ggml_fp16_t *) read_buf.data(), nelements);
+
+                ggml_backend_tensor_set(tensor, read_buf.data(), 0, ggml_nbytes(tensor));
+            } else if (tensor->buffer == nullptr) {
+                // low-memory mode: the ggml format does not align the data, so a matrix that is not aligned to its
+                // elements is loaded into memory instead
+                const size_t offs  = mapping->offset;
+                const size_t align = std::min(ggml_type_size(tensor->type), sizeof(float));
+
+                if (offs % align == 0 && offs + ggml_nbytes(tensor) <= mapping->size) {
+                    ggml_backend_tensor_alloc(model.buffer_mapped, tensor, (char *) mapping->addr + offs);
+                    mapping->offset += ggml_nbytes(tensor);
+                    mapped_size     += ggml_nbytes(tensor);
+
+                    auto & pages = model.stream_pages[model.stream_slot.at(tensor)];
+                    pages.first  = std::min(pages.first,  offs/page_size*page_size);
+                    pages.second = std::max(pages.second, GGML_PAD(offs + ggml_nbytes(tensor), page_size));
+                } else {
+                    ggml_backend_buffer_t buf = ggml_backend_buft_alloc_buffer(ggml_backend_cpu_buffer_type(), ggml_nbytes(tensor));
+                    if (!buf) {
+                        WHISPER_LOG_ERROR("%s: failed to allocate tensor '%s'\n", __func__, name.data());
+                        return false;
+                    }
+                    model.buffers.emplace_back(buf);
+                    model.stream_slot.erase(tensor);
+                    n_unaligned++;
+
+                    ggml_backend_tensor_alloc(buf, tensor, ggml_backend_buffer_get_base(buf));
+                    loader->read(loader->context, tensor->data, ggml_nbytes(tensor));
+                }
+            } else if (ggml_backend_buffer_is_host(tensor->buffer)) {
                 // for the CPU and Metal backend, we can read directly into the tensor
                 loader->read(loader->context, tensor->data, ggml_nbytes(tensor));
                 BYTESWAP_TENSOR(tensor);
@@ -1943,6 +2413,11 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
 
         WHISPER_LOG_INFO("%s: model size    = %7.2f MB\n", __func__, total_size/1e6);
 
+        if (mapping) {
+            WHISPER_LOG_INFO("%s: mapped size   = %7.2f MB (low-memory mode)\n", __func__, mapped_size/1e6);
+            WHISPER_LOG_INFO("%s: unaligned     = %7d matrices loaded into memory (low-memory mode)\n", __func__, n_unaligned);
+        }
+
         if (model.n_loaded == 0) {
             WHISPER_LOG_WARN("%s: WARN no tensors loaded from model file - assuming empty model for testing\n", __func__);
         } else if (model.n_loaded != (int) model.tensors.size()) {
@@ -1978,20 +2453,27 @@ static bool whisper_encode_external(const whisper_state & wstate) {
     return use_coreml || use_openvino;
 }
 
+// mel_offset >= 0: the input is a view of the window in wstate.mel, which must be bound with whisper_state_bind_mel
+// mel_offset <  0: the input is the "mel" tensor, to be filled with the window
+// col_reuse > 0: the columns [WHISPER_CONV_CACHE_HEAD, col_reuse) of embd_conv have been reused, they are not computed
+// add_pe: add the positional embedding to the output, only when nothing is reused
 static struct ggml_cgraph * whisper_build_graph_conv(
         whisper_context & wctx,
-          whisper_state & wstate) {
+          whisper_state & wstate,
+                    int   mel_offset = -1,
+                    int   col_reuse  = 0,
+                   bool   add_pe     = true) {
     const auto & model   = wctx.model;
     const auto & hparams = model.hparams;
 
     const int n_ctx   = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : hparams.n_audio_ctx;
-    const int n_state = hparams.n_audio_state; GGML_UNUSED(n_state);
+    const int n_state = hparams.n_audio_state;
 
     const int n_mels = hparams.n_mels;
 
     struct ggml_init_params params = {
-        /*.mem_size   =*/ wstate.sched_conv.meta.size(),
-        /*.mem_buffer =*/ wstate.sched_conv.meta.data(),
+        /*.mem_size   =*/ wstate.meta_conv.size(),
+        /*.mem_buffer =*/ wstate.meta_conv.data(),
         /*.no_alloc   =*/ true,
     };
 
@@ -1999,41 +2481,88 @@ static struct ggml_cgraph * whisper_build_graph_conv(
 
     ggml_cgraph * gf = ggml_new_graph(ctx0);
 
-    struct ggml_tensor * mel = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, 2*n_ctx, n_mels);
-    ggml_set_name(mel, "mel");
-    ggml_set_input(mel);
+    struct ggml_tensor * mel = nullptr;
+
+    if (mel_offset >= 0) {
+        // the spectrogram is [n_mels][n_len], so the window is a view with the row stride of the spectrogram
+        struct ggml_tensor * mel_all = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, wstate.mel.n_len, n_mels);
+        ggml_set_name(mel_all, "mel_all");
+
+        ggml_backend_tensor_alloc(wstate.mel_buffer, mel_all, (void *) wstate.mel.data.data());
+
+        mel = ggml_view_2d(ctx0, mel_all, 2*n_ctx, n_mels, mel_all->nb[1], mel_offset*ggml_element_size(mel_all));
+        ggml_set_name(mel, "mel");
+    } else {
+        mel = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, 2*n_ctx, n_mels);
+        ggml_set_name(mel, "mel");
+        ggml_set_input(mel);
+    }
 
     struct ggml_tensor * cur = nullptr;
 
     if (!whisper_encode_external(wstate)) {
         // convolution + gelu
-        {
-            cur = ggml_conv_1d_ph(ctx0, model.e_conv_1_w, mel, 1, 1);
+        auto conv_stem = [&](struct ggml_tensor * inp) {
+            struct ggml_tensor * cur = ggml_conv_1d_ph(ctx0, model.e_conv_1_w, inp, 1, 1);
             cur = ggml_add(ctx0, cur, model.e_conv_1_b);
 
             cur = ggml_gelu(ctx0, cur);
 
-            cur = ggml_conv_1d_ph(ctx0, model.e_conv_2_w, cur, 2, 1);
-            cur = ggml_add(ctx0, cur, model.e_conv_2_b);
+            // the second conv is ggml_conv_1d_ph with the operands of the mul_mat swapped, so that its output is
+            // [n_state, n_ctx] like the input of the encoder, and the bias, the GELU and the positional embedding
+            // are applied along the rows instead of transposing the output in the encoder
+            const auto & w = model.e_conv_2_w;
+
+            cur = ggml_im2col(ctx0, w, cur, 2, 0, 1, 0, 1, 0, false, w->type == GGML_TYPE_F32 ? GGML_TYPE_F32 : GGML_TYPE_F16);
+            cur = ggml_mul_mat(ctx0,
+                    ggml_reshape_2d(ctx0, w, w->ne[0]*w->ne[1], w->ne[2]),
+                    ggml_reshape_2d(ctx0, cur, cur->ne[0], cur->ne[1]*cur->ne[2]));
+            cur = ggml_add(ctx0, cur, ggml_reshape_1d(ctx0, model.e_conv_2_b, n_state));
 
             cur = ggml_gelu(ctx0, cur);
-        }
 
-        ggml_set_name(cur, "embd_conv");
-        wstate.embd_conv = cur;
-    } else {
-        ggml_build_forward_expand(gf, mel);
+            return cur;
+        };
 
-        cur = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, n_ctx);
-        ggml_set_input(cur); // the external encoder will write into this tensor
+        const size_t nb1 = n_state*ggml_element_size(wstate.embd_conv);
 
-        ggml_set_name(cur, "embd_enc");
-        wstate.embd_enc = cur;
-    }
+        if (col_reuse == 0) {
+            cur = conv_stem(mel);
 
-    ggml_set_output(cur);
+            if (add_pe) {
+                cur = ggml_add(ctx0, cur, ggml_view_2d(ctx0, model.e_pe, n_state, n_ctx, model.e_pe->nb[1], 0));
+            }
 
-    ggml_build_forward_expand(gf, cur);
+            cur = ggml_cpy(ctx0, cur, ggml_view_2d(ctx0, wstate.embd_conv, n_state, n_ctx, nb1, 0));
+            ggml_set_name(cur, "embd_conv");
+
+            ggml_build_forward_expand(gf, cur);
+        } else {
+            // output column t depends on the mel frames [2t - 2, 2t + 2], with zero padding outside of the window
+            // the head and the tail are computed from the frames they depend on, and the extra columns are dropped
+            const int n_head = WHISPER_CONV_CACHE_HEAD;
+            const int n_tail = n_ctx - col_reuse;
+
+            GGML_ASSERT(!add_pe);
+
+            struct ggml_tensor * head = conv_stem(ggml_view_2d(ctx0, mel, 2*n_head + 2, n_mels, mel->nb[1], 0));
+            head = ggml_cpy(ctx0,
+                    ggml_view_2d(ctx0, head, n_state, n_head, head->nb[1], 0),
+                    ggml_view_2d(ctx0, wstate.embd_conv, n_state, n_head, nb1, 0));
+
+            // the first column of the tail starts one column before it, within the padding of the sub-window
+            struct ggml_tensor * tail = conv_stem(ggml_view_2d(ctx0, mel, 2*n_tail + 2, n_mels, mel->nb[1], (2*col_reuse - 2)*mel->nb[0]));
+            tail = ggml_cpy(ctx0,
+                    ggml_view_2d(ctx0, tail, n_state, n_tail, tail->nb[1], tail->nb[1]),
+                    ggml_view_2d(ctx0, wstate.embd_conv, n_state, n_tail, nb1, col_reuse*nb1));
+
+            ggml_build_forward_expand(gf, head);
+            ggml_build_forward_expand(gf, tail);
+        }
+    } else {
+        // the external encoder writes directly into wstate.embd_enc
+        ggml_build_forward_expand(gf, mel);
+    }
 
     ggml_free(ctx0);
 
@@ -2060,8 +2589,8 @@ static struct ggml_cgraph * whisper_build_graph_encoder(
     const int n_ctx_pad = GGML_PAD(n_ctx, 256);
 
     struct ggml_init_params params = {
-        /*.mem_size   =*/ wstate.sched_encode.meta.size(),
-        /*.mem_buffer =*/ wstate.sched_encode.meta.data(),
+        /*.mem_size   =*/ wstate.meta_encode.size(),
+        /*.mem_buffer =*/ wstate.meta_encode.data(),
         /*.no_alloc   =*/ true,
     };
 
@@ -2069,7 +2598,7 @@ static struct ggml_cgraph * whisper_build_graph_encoder(
 
     ggml_cgraph * gf = ggml_new_graph_custom(ctx0, WHISPER_MAX_NODES, false);
 
-    struct ggml_tensor * cur = ggml_view_tensor(ctx0, wstate.embd_conv);
+    struct ggml_tensor * cur = ggml_view_2d(ctx0, wstate.embd_conv, n_state, n_ctx, n_state*ggml_element_size(wstate.embd_conv), 0);
 
     const float KQscale = 1.0f/sqrtf(float(n_state_head));
 
@@ -2090,8 +2619,11 @@ static struct ggml_cgraph * whisper_build_graph_encoder(
     const size_t e_pe_stride = model.e_pe->ne[0]*ggml_element_size(model.e_pe);
     const size_t e_pe_offset = model.e_pe->ne[0]*ggml_element_size(model.e_pe)*n_ctx*iter;
 
-    struct ggml_tensor * e_pe = ggml_view_2d(ctx0, model.e_pe, model.e_pe->ne[0], n_ctx, e_pe_stride, e_pe_offset);
-    cur = ggml_add(ctx0, e_pe, ggml_cont(ctx0, ggml_transpose(ctx0, cur)));
+    // the conv graph adds the positional embedding, unless the conv stem output is cached for the next window
+    if (!wstate.embd_conv_pe) {
+        struct ggml_tensor * e_pe = ggml_view_2d(ctx0, model.e_pe, model.e_pe->ne[0], n_ctx, e_pe_stride, e_pe_offset);
+        cur = ggml_add(ctx0, cur, e_pe);
+    }
 
     // ===================================================================
 
@@ -2253,9 +2785,10 @@ static struct ggml_cgraph * whisper_build_graph_encoder(
                 model.e_ln_b);
     }
 
-    ggml_build_forward_expand(gf, cur);
+    cur = ggml_cpy(ctx0, cur, ggml_view_2d(ctx0, wstate.embd_enc, n_state, n_ctx, n_state*ggml_element_size(wstate.embd_enc), 0));
+    ggml_set_name(cur, "embd_enc");
 
-    wstate.embd_enc = cur;
+    ggml_build_forward_expand(gf, cur);
 
     //ggml_graph_print(gf);
 
@@ -2289,8 +2822,8 @@ static struct ggml_cgraph * whisper_build_graph_cross(
     const int n_ctx_pad = GGML_PAD(n_ctx, 256);
 
     struct ggml_init_params params = {
-        /*.mem_size   =*/ wstate.sched_cross.meta.size(),
-        /*.mem_buffer =*/ wstate.sched_cross.meta.data(),
+        /*.mem_size   =*/ wstate.meta_cross.size(),
+        /*.mem_buffer =*/ wstate.meta_cross.data(),
         /*.no_alloc   =*/ true,
     };
 
@@ -2298,7 +2831,7 @@ static struct ggml_cgraph * whisper_build_graph_cross(
 
     ggml_cgraph * gf = ggml_new_graph(ctx0);
 
-    struct ggml_tensor * cur = ggml_view_tensor(ctx0, wstate.embd_enc);
+    struct ggml_tensor * cur = ggml_view_2d(ctx0, wstate.embd_enc, n_state, n_ctx, n_state*ggml_element_size(wstate.embd_enc), 0);
 
     const float  Kscale = pow(float(n_state_head), -0.25);
 
@@ -2319,25 +2852,16 @@ static struct ggml_cgraph * whisper_build_graph_cross(
                     Vcross,
                     layer.cross_attn_v_b);
 
-        struct ggml_tensor * k;
-        struct ggml_tensor * v;
-
-        if (wctx.params.flash_attn) {
-            k = ggml_view_1d(ctx0, wstate.kv_cross.k, n_state*n_ctx,
-                    (ggml_element_size(wstate.kv_cross.k)*n_state)*(il*n_ctx_pad));
+        // the layout in which the decoders read them, with and without flash attention (see whisper_build_graph_decoder):
+        // per layer, n_ctx_pad rows of K and n_state rows of V transposed, which are padded to n_ctx_pad
+        Vcross = ggml_transpose(ctx0, ggml_reshape_2d(ctx0, Vcross, n_state, n_ctx));
 
-            v = ggml_view_1d(ctx0, wstate.kv_cross.v, n_state*n_ctx,
-                    (ggml_element_size(wstate.kv_cross.v)*n_state)*(il*n_ctx_pad));
-        } else {
-            Vcross = ggml_transpose(ctx0, ggml_reshape_2d(ctx0, Vcross, n_state, n_ctx));
-
-            k = ggml_view_1d(ctx0, wstate.kv_cross.k, n_state*n_ctx,
-                    (ggml_element_size(wstate.kv_cross.k)*n_state)*(il*n_ctx));
+        struct ggml_tensor * k = ggml_view_1d(ctx0, wstate.kv_cross.k, n_state*n_ctx,
+                (ggml_element_size(wstate.kv_cross.k)*n_state)*(il*n_ctx_pad));
 
-            v = ggml_view_2d(ctx0, wstate.kv_cross.v, n_ctx, n_state,
-                    (   n_ctx)*ggml_element_size(wstate.kv_cross.v),
-                    (il*n_ctx)*ggml_element_size(wstate.kv_cross.v)*n_state);
-        }
+        struct ggml_tensor * v = ggml_view_2d(ctx0, wstate.kv_cross.v, n_ctx, n_state,
+                (    n_ctx_pad)*ggml_element_size(wstate.kv_cross.v),
+                (il*n_ctx_pad)*ggml_element_size(wstate.kv_cross.v)*n_state);
 
         ggml_build_forward_expand(gf, ggml_cpy(ctx0, Kcross, k));
         ggml_build_forward_expand(gf, ggml_cpy(ctx0, Vcross, v));
@@ -2350,43 +2874,170 @@ static struct ggml_cgraph * whisper_build_graph_cross(
     return gf;
 }
 
-// evaluate the encoder with the given state
-//
-// given audio recording (more specifically, its log mel spectrogram), runs forward pass of the encoder
-// part of the transformer model and returns the encoded features
-//
-//   - wctx:      the model
-//   - wstate:     the state of the encoder
-//   - n_threads:  number of threads to use
-//   - mel_offset: offset in the mel spectrogram (i.e. audio offset)
-//
-static bool whisper_encode_internal(
-        whisper_context & wctx,
-          whisper_state & wstate,
-              const int   mel_offset,
-              const int   n_threads,
-    ggml_abort_callback   abort_callback,
-                   void * abort_callback_data) {
-    const int64_t t_start_us = ggml_time_us();
+// reuse the conv stem output of the previous window of the stream for the columns that see the same mel frames
+// the first columns are always computed, as the first mel frames of a call are padded by reflection
+// returns the end of the reused columns [WHISPER_CONV_CACHE_HEAD, col_reuse), or 0 if nothing is reused
+static int whisper_conv_cache_reuse(whisper_state & wstate, int64_t frame, int mel_offset, int n_ctx) {
+    const auto & cache = wstate.conv_cache;
 
-    // conv
-    {
-        auto & sched = wstate.sched_conv.sched;
+    if (frame < 0 || cache.frame < 0 || cache.n_ctx != n_ctx) {
+        return 0;
+    }
 
-        ggml_cgraph * gf = whisper_build_graph_conv(wctx, wstate);
+    // the shift in output columns, the conv stem has a stride of 2
+    const int64_t d = frame - cache.frame;
+    if (d <= 0 || d % 2 != 0 || d >= 2*n_ctx) {
+        return 0;
+    }
 
-        if (!ggml_backend_sched_alloc_graph(sched, gf)) {
-            // should never happen as we pre-allocate the memory
-            return false;
-        }
+    // column t of this window is column t + d/2 of the previous one, which has to be away from its right edge
+    int col_reuse = n_ctx - 1 - d/2;
 
-        struct ggml_tensor * mel = ggml_graph_get_tensor(gf, "mel");
+    // and the mel frames [2t - 2, 2t + 2] have to be the same - they are not if the clamping of the spectrogram changed
+    const int n_mel = wstate.mel.n_mel;
+    const int n_len = wstate.mel.n_len;
 
-        // set the input
-        {
-            const auto & mel_inp = wstate.mel;
-            const int n_ctx      = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : wctx.model.hparams.n_audio_ctx;
+    // frames [i0, n_same) are the same in all the bands
+    const int i0 = 2*WHISPER_CONV_CACHE_HEAD - 2;
+
+    int n_same = 2*col_reuse + 1;
+    for (int j = 0; j < n_mel && n_same > i0; ++j) {
+        const float * cur  = wstate.mel.data.data() + j*n_len + mel_offset;
+        const float * prev = cache.mel.data()       + j*2*n_ctx + d;
+
+        int i = i0;
+        while (i < n_same && cur[i] == prev[i]) {
+            i++;
+        }
+        n_same = i;
+    }
+
+    col_reuse = std::min(col_reuse, (n_same - 1)/2);
+
+    if (col_reuse < WHISPER_CONV_CACHE_HEAD + WHISPER_CONV_CACHE_MIN) {
+        return 0;
+    }
+
+    const int n_state = wstate.embd_conv->ne[0];
+    const int n_cols  = col_reuse - WHISPER_CONV_CACHE_HEAD;
+
+    const size_t offs = (size_t) WHISPER_CONV_CACHE_HEAD*n_state;
+    ggml_backend_tensor_set(wstate.embd_conv, cache.embd.data() + offs + (d/2)*n_state, offs*sizeof(float), n_cols*n_state*sizeof(float));
+
+    return col_reuse;
+}
+
+static void whisper_conv_cache_store(whisper_state & wstate, int64_t frame, int mel_offset, int n_ctx) {
+    auto & cache = wstate.conv_cache;
+
+    cache.frame = frame;
+    if (frame < 0) {
+        return;
+    }
+
+    const int n_mel   = wstate.mel.n_mel;
+    const int n_len   = wstate.mel.n_len;
+    const int n_state = wstate.embd_conv->ne[0];
+
+    cache.n_ctx = n_ctx;
+
+    cache.mel.resize(n_mel*2*n_ctx);
+    for (int j = 0; j < n_mel; ++j) {
+        memcpy(cache.mel.data() + j*2*n_ctx, wstate.mel.data.data() + j*n_len + mel_offset, 2*n_ctx*sizeof(float));
+    }
+
+    cache.embd.resize(n_state*n_ctx);
+    ggml_backend_tensor_get(wstate.embd_conv, cache.embd.data(), 0, cache.embd.size()*sizeof(float));
+}
+
+// wrap the spectrogram of the state in a host buffer, rewrapped when mel.data has been reallocated
+static bool whisper_state_bind_mel(whisper_state & wstate) {
+    const float * data = wstate.mel.data.data();
+    const size_t  size = wstate.mel.data.size()*sizeof(float);
+
+    if (wstate.mel_buffer && wstate.mel_buffer_data == data && wstate.mel_buffer_size == size) {
+        return true;
+    }
+
+    if (wstate.mel_buffer) {
+        ggml_backend_buffer_free(wstate.mel_buffer);
+        wstate.mel_buffer      = nullptr;
+        wstate.mel_buffer_data = nullptr;
+        wstate.mel_buffer_size = 0;
+    }
+
+    if (size == 0) {
+        return false;
+    }
+
+    // the buffer has to start at an aligned address, only the spectrogram itself is accessed through it
+    const uintptr_t align = ggml_backend_buft_get_alignment(ggml_backend_cpu_buffer_type());
+    const uintptr_t base  = (uintptr_t) data & ~(align - 1);
+
+    wstate.mel_buffer = ggml_backend_cpu_buffer_from_ptr((void *) base, (uintptr_t) data + size - base);
+    if (!wstate.mel_buffer) {
+        return false;
+    }
+
+    wstate.mel_buffer_data = data;
+    wstate.mel_buffer_size = size;
+
+    return true;
+}
+
+// evaluate the encoder with the given state
+//
+// given audio recording (more specifically, its log mel spectrogram), runs forward pass of the encoder
+// part of the transformer model and returns the encoded features
+//
+//   - wctx:      the model
+//   - wstate:     the state of the encoder
+//   - n_threads:  number of threads to use
+//   - mel_offset: offset in the mel spectrogram (i.e. audio offset)
+//
+static bool whisper_encode_internal(
+        whisper_context & wctx,
+          whisper_state & wstate,
+              const int   mel_offset,
+              const int   n_threads,
+    ggml_abort_callback   abort_callback,
+                   void * abort_callback_data) {
+    const int64_t t_start_us = ggml_time_us();
+
+    // conv
+    {
+        auto & sched = wstate.sched;
+
+        const auto & mel_inp = wstate.mel;
+        const int n_ctx      = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : wctx.model.hparams.n_audio_ctx;
+
+        // a window that lies within the spectrogram is read in place, the others are copied and padded with zeros
+        // the external encoders need a contiguous window
+        const bool mel_in_place =
+            !whisper_encode_external(wstate) &&
+            mel_offset >= 0 && mel_offset + 2*n_ctx <= mel_inp.n_len &&
+            mel_inp.n_mel == wctx.model.hparams.n_mels &&
+            whisper_state_bind_mel(wstate);
 
+        // absolute mel frame of the window in a stream, the conv stem output of overlapping windows is reused
+        const int64_t frame = mel_in_place && wstate.mel_frame0 >= 0 ? wstate.mel_frame0 + mel_offset : -1;
+
+        const int col_reuse = whisper_conv_cache_reuse(wstate, frame, mel_offset, n_ctx);
+
+        // the conv stem output of a stream is kept for the next window, so the encoder adds the positional embedding
+        const bool add_pe = frame < 0;
+
+        ggml_cgraph * gf = whisper_build_graph_conv(wctx, wstate, mel_in_place ? mel_offset : -1, col_reuse, add_pe);
+
+        if (!ggml_backend_sched_alloc_graph(sched, gf)) {
+            // should never happen as we pre-allocate the memory
+            return false;
+        }
+
+        struct ggml_tensor * mel = ggml_graph_get_tensor(gf, "mel");
+
+        // set the input
+        if (!mel_in_place) {
             assert(mel->type == GGML_TYPE_F32);
             assert(mel_inp.n_mel == wctx.model.hparams.n_mels);
 
@@ -2411,6 +3062,10 @@ static bool whisper_encode_internal(
             if (!ggml_graph_compute_helper(sched, gf, n_threads)) {
                 return false;
             }
+
+            wstate.embd_conv_pe = add_pe;
+
+            whisper_conv_cache_store(wstate, frame, mel_offset, n_ctx);
         } else {
             ggml_backend_sched_reset(sched);
 
@@ -2424,7 +3079,7 @@ static bool whisper_encode_internal(
 
     // encoder
     if (!whisper_encode_external(wstate)) {
-        auto & sched = wstate.sched_encode.sched;
+        auto & sched = wstate.sched;
 
         ggml_cgraph * gf = whisper_build_graph_encoder(wctx, wstate);
 
@@ -2440,7 +3095,7 @@ static bool whisper_encode_internal(
 
     // cross
     {
-        auto & sched = wstate.sched_cross.sched;
+        auto & sched = wstate.sched;
 
         ggml_cgraph * gf = whisper_build_graph_cross(wctx, wstate);
 
@@ -2488,11 +3143,20 @@ static struct ggml_cgraph * whisper_build_graph_decoder(
     const int32_t n_kv    = worst_case ? n_ctx            : kv_self.n;
     const int32_t kv_head = worst_case ? n_ctx - n_tokens : kv_self.head;
 
+    // number of tokens that need logits, the worst case computes them for all tokens
+    int n_outputs = n_tokens;
+    if (!worst_case) {
+        n_outputs = 0;
+        for (int i = 0; i < n_tokens; ++i) {
+            n_outputs += batch.logits[i] != 0;
+        }
+    }
+
     //WHISPER_LOG_DEBUG("%s: n_past = %d, n_tokens = %d, n_audio_ctx = %d, n_ctx = %d\n", __func__, n_past, n_tokens, n_audio_ctx, n_ctx);
 
     struct ggml_init_params params = {
-        /*.mem_size   =*/ wstate.sched_decode.meta.size(),
-        /*.mem_buffer =*/ wstate.sched_decode.meta.data(),
+        /*.mem_size   =*/ wstate.meta_decode.size(),
+        /*.mem_buffer =*/ wstate.meta_decode.data(),
         /*.no_alloc   =*/ true,
     };
 
@@ -2668,6 +3332,9 @@ static struct ggml_cgraph * whisper_build_graph_decoder(
         }
 
         // cross-attention
+        // also with flash attention, the attention over the audio is computed as two matrix multiplications: every
+        // K and V row of the window is then read once for all the tokens of the batch (e.g. one per beam or best_of
+        // decoder), while flash attention reads all of them again for every token
         {
             struct ggml_tensor * Qcur = ggml_mul_mat(ctx0,
                     layer.cross_attn_q_w,
@@ -2682,70 +3349,50 @@ static struct ggml_cgraph * whisper_build_graph_decoder(
                         ggml_reshape_3d(ctx0, Qcur, n_state_head, n_head, n_tokens),
                         0, 2, 1, 3);
 
-            if (wctx.params.flash_attn) {
-                struct ggml_tensor * Kcross =
-                    ggml_view_3d(ctx0, wstate.kv_cross.k,
-                            n_state_head, n_audio_ctx_pad, n_head,
-                            ggml_element_size(wstate.kv_cross.k)*n_state,
-                            ggml_element_size(wstate.kv_cross.k)*n_state_head,
-                            ggml_element_size(wstate.kv_cross.k)*n_state*n_audio_ctx_pad*il);
-
-                struct ggml_tensor * Vcross =
-                    ggml_view_3d(ctx0, wstate.kv_cross.v,
-                            n_state_head, n_audio_ctx_pad, n_head,
-                            ggml_element_size(wstate.kv_cross.v)*n_state,
-                            ggml_element_size(wstate.kv_cross.v)*n_state_head,
-                            ggml_element_size(wstate.kv_cross.v)*n_state*n_audio_ctx_pad*il);
-
-                cur = ggml_flash_attn_ext(ctx0, Q, Kcross, Vcross, nullptr, KQscale, 0.0f, 0.0f);
+            struct ggml_tensor * Kcross =
+                ggml_view_3d(ctx0, wstate.kv_cross.k,
+                        n_state_head, n_audio_ctx, n_head,
+                        ggml_element_size(wstate.kv_cross.k)*n_state,
+                        ggml_element_size(wstate.kv_cross.k)*n_state_head,
+                        ggml_element_size(wstate.kv_cross.k)*n_state*n_audio_ctx_pad*il);
 
-                cur = ggml_reshape_2d(ctx0, cur, n_state, n_tokens);
-            } else {
-                struct ggml_tensor * Kcross =
-                    ggml_view_3d(ctx0, wstate.kv_cross.k,
-                            n_state_head, n_audio_ctx, n_head,
-                            ggml_element_size(wstate.kv_cross.k)*n_state,
-                            ggml_element_size(wstate.kv_cross.k)*n_state_head,
-                            ggml_element_size(wstate.kv_cross.k)*n_state*n_audio_ctx*il);
-
-                struct ggml_tensor * Vcross =
-                    ggml_view_3d(ctx0, wstate.kv_cross.v,
-                            n_audio_ctx, n_state_head, n_head,
-                            n_audio_ctx*ggml_element_size(wstate.kv_cross.v),
-                            n_audio_ctx*ggml_element_size(wstate.kv_cross.v)*n_state_head,
-                            n_audio_ctx*ggml_element_size(wstate.kv_cross.v)*n_state*il);
-
-                // ------
+            struct ggml_tensor * Vcross =
+                ggml_view_3d(ctx0, wstate.kv_cross.v,
+                        n_audio_ctx, n_state_head, n_head,
+                        n_audio_ctx_pad*ggml_element_size(wstate.kv_cross.v),
+                        n_audio_ctx_pad*ggml_element_size(wstate.kv_cross.v)*n_state_head,
+                        n_audio_ctx_pad*ggml_element_size(wstate.kv_cross.v)*n_state*il);
 
-                // K * Q
-                struct ggml_tensor * KQ = ggml_mul_mat(ctx0, Kcross, Q);
+            // ------
 
-                struct ggml_tensor * KQ_soft_max = ggml_soft_max_ext(ctx0, KQ, nullptr, KQscale, 0.0f);
+            // K * Q
+            struct ggml_tensor * KQ = ggml_mul_mat(ctx0, Kcross, Q);
 
-                // [EXPERIMENTAL] Token-level timestamps with DTW
-                if (wctx.params.dtw_token_timestamps) {
-                    if (wstate.aheads_masks.m[il] != nullptr) {
-                        struct ggml_tensor * aheads_KQs = ggml_reshape_2d(ctx0, KQ_soft_max, KQ_soft_max->ne[0] * KQ_soft_max->ne[1], KQ_soft_max->ne[2]);
-                        aheads_KQs = ggml_transpose(ctx0, aheads_KQs);
-                        aheads_KQs = ggml_cont(ctx0, aheads_KQs);
-                        aheads_KQs = ggml_mul_mat(ctx0, wstate.aheads_masks.m[il], aheads_KQs);
-                        aheads_KQs = ggml_transpose(ctx0, aheads_KQs);
-                        aheads_KQs = ggml_cont(ctx0, aheads_KQs);
-                        aheads_KQs = ggml_reshape_3d(ctx0, aheads_KQs, KQ_soft_max->ne[0], KQ_soft_max->ne[1], wstate.aheads_masks.m[il]->ne[1]);
-                        if (aheads_cross_QKs == NULL) {
-                            aheads_cross_QKs = aheads_KQs;
-                        } else {
-                            aheads_cross_QKs = ggml_concat(ctx0, aheads_cross_QKs, aheads_KQs, 2);
-                        }
+            struct ggml_tensor * KQ_soft_max = ggml_soft_max_ext(ctx0, KQ, nullptr, KQscale, 0.0f);
+
+            // [EXPERIMENTAL] Token-level timestamps with DTW
+            if (wctx.params.dtw_token_timestamps) {
+                if (wstate.aheads_masks.m[il] != nullptr) {
+                    struct ggml_tensor * aheads_KQs = ggml_reshape_2d(ctx0, KQ_soft_max, KQ_soft_max->ne[0] * KQ_soft_max->ne[1], KQ_soft_max->ne[2]);
+                    aheads_KQs = ggml_transpose(ctx0, aheads_KQs);
+                    aheads_KQs = ggml_cont(ctx0, aheads_KQs);
+                    aheads_KQs = ggml_mul_mat(ctx0, wstate.aheads_masks.m[il], aheads_KQs);
+                    aheads_KQs = ggml_transpose(ctx0, aheads_KQs);
+                    aheads_KQs = ggml_cont(ctx0, aheads_KQs);
+                    aheads_KQs = ggml_reshape_3d(ctx0, aheads_KQs, KQ_soft_max->ne[0], KQ_soft_max->ne[1], wstate.aheads_masks.m[il]->ne[1]);
+                    if (aheads_cross_QKs == NULL) {
+                        aheads_cross_QKs = aheads_KQs;
+                    } else {
+                        aheads_cross_QKs = ggml_concat(ctx0, aheads_cross_QKs, aheads_KQs, 2);
                     }
                 }
+            }
 
-                struct ggml_tensor * KQV = ggml_mul_mat(ctx0, Vcross, KQ_soft_max);
+            struct ggml_tensor * KQV = ggml_mul_mat(ctx0, Vcross, KQ_soft_max);
 
-                struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
+            struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
 
-                cur = ggml_cont_2d(ctx0, KQV_merged, n_state, n_tokens);
-            }
+            cur = ggml_cont_2d(ctx0, KQV_merged, n_state, n_tokens);
         }
 
         // projection
@@ -2816,12 +3463,30 @@ static struct ggml_cgraph * whisper_build_graph_decoder(
                 model.d_ln_b);
     }
 
-    // compute logits only for the last token
-    // comment this line to compute logits for all n_tokens
-    // might be useful in the future
-    //cur = ggml_view_2d(ctx0, cur, cur->ne[0], 1, cur->nb[1], (cur->ne[1] - 1)*cur->nb[1]);
+    // the attention weights of the DTW timestamps are read after the decoder, so no fallback graph can run in between
+    const bool use_shortlist = !worst_case && wstate.vocab_shortlist && model.d_te_short && !save_alignment_heads_QKs;
 
-    struct ggml_tensor * logits = ggml_mul_mat(ctx0, model.d_te, cur);
+    // compute logits only for the tokens that have batch.logits set (e.g. the last token of the prompt)
+    // the rows of the output are in the order of the tokens
+    if (n_outputs < n_tokens) {
+        struct ggml_tensor * inp_out_ids = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_outputs);
+        ggml_set_name(inp_out_ids, "inp_out_ids");
+        ggml_set_input(inp_out_ids);
+
+        cur = ggml_get_rows(ctx0, cur, inp_out_ids);
+    }
+
+    struct ggml_tensor * logits = nullptr;
+
+    if (use_shortlist) {
+        // kept for the tokens that fall back to the full vocabulary
+        ggml_set_name(cur, "hidden");
+        ggml_set_output(cur);
+
+        logits = ggml_mul_mat(ctx0, model.d_te_short, cur);
+    } else {
+        logits = ggml_mul_mat(ctx0, model.d_te, cur);
+    }
 
     // [EXPERIMENTAL] Token-level timestamps with DTW
     if (wctx.params.dtw_token_timestamps && aheads_cross_QKs != nullptr) {
@@ -2840,6 +3505,36 @@ static struct ggml_cgraph * whisper_build_graph_decoder(
     return gf;
 }
 
+// logits over the full vocabulary for decoder outputs that were projected onto the vocabulary shortlist
+static struct ggml_cgraph * whisper_build_graph_logits(
+         whisper_context & wctx,
+         whisper_state   & wstate,
+                     int   n_rows) {
+    const auto & model = wctx.model;
+
+    struct ggml_init_params params = {
+        /*.mem_size   =*/ wstate.meta_decode.size(),
+        /*.mem_buffer =*/ wstate.meta_decode.data(),
+        /*.no_alloc   =*/ true,
+    };
+
+    struct ggml_context * ctx0 = ggml_init(params);
+
+    ggml_cgraph * gf = ggml_new_graph(ctx0);
+
+    struct ggml_tensor * hidden = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, model.hparams.n_text_state, n_rows);
+    ggml_set_name(hidden, "hidden");
+    ggml_set_input(hidden);
+
+    struct ggml_tensor * logits = ggml_mul_mat(ctx0, model.d_te, hidden);
+
+    ggml_build_forward_expand(gf, logits);
+
+    ggml_free(ctx0);
+
+    return gf;
+}
+
 // evaluate the decoder
 //
 // given text prompt + audio features -> computes the logits for the next token
@@ -2869,9 +3564,12 @@ static bool whisper_decode_internal(
     auto & logits_out = wstate.logits;
 
     struct ggml_tensor * logits;
+    struct ggml_tensor * hidden = nullptr;
 
     // find KV slot for the batch
     {
+        whisper_hot_timer timer(wstate, WHISPER_HOT_KV);
+
         auto & kv_self = wstate.kv_self;
 
         if (!whisper_kv_cache_find_slot(kv_self, batch)) {
@@ -2887,7 +3585,7 @@ static bool whisper_decode_internal(
 
     // decoder
     {
-        auto & sched = wstate.sched_decode.sched;
+        auto & sched = wstate.sched;
 
         ggml_cgraph * gf = whisper_build_graph_decoder(wctx, wstate, batch, save_alignment_heads_QKs, false);
 
@@ -2904,10 +3602,7 @@ static bool whisper_decode_internal(
 
         {
             struct ggml_tensor * position = ggml_graph_get_tensor(gf, "position");
-            for (int i = 0; i < n_tokens; ++i) {
-                const int32_t val = batch.pos[i];
-                ggml_backend_tensor_set(position, &val, i*sizeof(int32_t), sizeof(int32_t));
-            }
+            ggml_backend_tensor_set(position, batch.pos, 0, n_tokens*ggml_element_size(position));
         }
 
         {
@@ -2917,46 +3612,158 @@ static bool whisper_decode_internal(
 
             const int32_t n_kv = kv_self.n;
 
-            wstate.inp_mask.resize(ggml_nelements(KQ_mask));
+            // the mask is written in place when the compute buffer is in host memory
+            const bool is_host = ggml_backend_buffer_is_host(KQ_mask->buffer);
+            if (!is_host) {
+                wstate.inp_mask.resize(ggml_nelements(KQ_mask));
+            }
+
+            float * data = is_host ? (float *) KQ_mask->data : wstate.inp_mask.data();
 
-            float * data = wstate.inp_mask.data();
-            memset(data, 0, ggml_nbytes(KQ_mask));
+            // the cells in flat arrays, so that the rows below are branch-free loops that the compiler vectorizes
+            auto & mask_pos = wstate.inp_mask_pos;
+            auto & mask_seq = wstate.inp_mask_seq;
 
-            for (int h = 0; h < 1; ++h) {
-                for (int j = 0; j < n_tokens; ++j) {
-                    const whisper_pos    pos    = batch.pos[j];
-                    const whisper_seq_id seq_id = batch.seq_id[j][0];
+            mask_pos.resize(n_kv);
+            mask_seq.resize(n_kv);
 
-                    for (int i = 0; i < n_kv; ++i) {
-                        if (!kv_self.cells[i].has_seq_id(seq_id) || kv_self.cells[i].pos > pos) {
-                            data[h*(n_kv*n_tokens) + j*n_kv + i] = -INFINITY;
-                        }
-                    }
+            for (int i = 0; i < n_kv; ++i) {
+                mask_pos[i] = kv_self.cells[i].pos;
+                mask_seq[i] = kv_self.cells[i].seq_mask;
+            }
+
+            for (int j = 0; j < n_tokens; ++j) {
+                const whisper_pos pos      = batch.pos[j];
+                const uint32_t    seq_mask = 1u << batch.seq_id[j][0];
+
+                float * row = data + j*n_kv;
+
+                for (int i = 0; i < n_kv; ++i) {
+                    row[i] = ((mask_seq[i] & seq_mask) != 0 && mask_pos[i] <= pos) ? 0.0f : -INFINITY;
                 }
+            }
 
-                for (int i = n_tokens; i < GGML_PAD(n_tokens, GGML_KQ_MASK_PAD); ++i) {
-                    for (int j = 0; j < n_kv; ++j) {
-                        data[h*(n_kv*n_tokens) + i*n_kv + j] = -INFINITY;
-                    }
+            std::fill(data + n_tokens*n_kv, data + ggml_nelements(KQ_mask), -INFINITY);
+
+            if (!is_host) {
+                ggml_backend_tensor_set(KQ_mask, data, 0, ggml_nbytes(KQ_mask));
+            }
+        }
+
+        struct ggml_tensor * inp_out_ids = ggml_graph_get_tensor(gf, "inp_out_ids");
+        if (inp_out_ids) {
+            std::vector<int32_t> out_ids;
+            out_ids.reserve(ggml_nelements(inp_out_ids));
+            for (int i = 0; i < n_tokens; ++i) {
+                if (batch.logits[i] != 0) {
+                    out_ids.push_back(i);
                 }
             }
 
-            ggml_backend_tensor_set(KQ_mask, wstate.inp_mask.data(), 0, ggml_nelements(KQ_mask)*sizeof(float));
+            ggml_backend_tensor_set(inp_out_ids, out_ids.data(), 0, ggml_nbytes(inp_out_ids));
         }
 
         logits = ggml_graph_node(gf, -1);
+        hidden = ggml_graph_get_tensor(gf, "hidden");
 
-        if (!ggml_graph_compute_helper(sched, gf, n_threads)) {
+        // computed synchronously: the CPU backend computes in the calling thread, and the next step needs the tokens
+        // sampled by every decoder from these logits, so there is no sampling work to overlap with the graph
+        // the logits are read before the scheduler is reset, the tensor is in the compute buffer
+        if (!ggml_graph_compute_helper(sched, gf, n_threads, false)) {
             return false;
         }
     }
 
     logits_out.resize(n_tokens*n_vocab);
-    for (int i = 0; i < n_tokens; i++) {
-        if (batch.logits[i] == 0) {
-            continue;
+
+    if (hidden == nullptr) {
+        // row k of the output holds the logits of the k-th token with batch.logits set
+        for (int i = 0, k = 0; i < n_tokens; i++) {
+            if (batch.logits[i] == 0) {
+                continue;
+            }
+            const int row = logits->ne[1] == n_tokens ? i : k++;
+            ggml_backend_tensor_get(logits, logits_out.data() + (n_vocab*i), sizeof(float)*(n_vocab*row), sizeof(float)*n_vocab);
+        }
+
+        ggml_backend_sched_reset(wstate.sched);
+    } else {
+        const auto & shortlist = model.shortlist;
+
+        const int n_short   = logits->ne[0];
+        const int n_outputs = logits->ne[1];
+        const int n_state   = hparams.n_text_state;
+
+        auto & logits_short = wstate.logits_short;
+
+        logits_short.resize(n_short*n_outputs);
+        ggml_backend_tensor_get(logits, logits_short.data(), 0, sizeof(float)*n_short*n_outputs);
+
+        // rows of the outputs that are not confident enough within the shortlist
+        std::vector<int> fallback;
+
+        for (int i = 0, k = 0; i < n_tokens; i++) {
+            if (batch.logits[i] == 0) {
+                continue;
+            }
+            const int row = n_outputs == n_tokens ? i : k++;
+
+            const float * src = logits_short.data() + n_short*row;
+                  float * dst = logits_out.data()   + n_vocab*i;
+
+            std::fill(dst, dst + n_vocab, -INFINITY);
+
+            float max = -INFINITY;
+            for (int j = 0; j < n_short; ++j) {
+                dst[shortlist[j]] = src[j];
+                max = std::max(max, src[j]);
+            }
+
+            double sum = 0.0;
+            for (int j = 0; j < n_short; ++j) {
+                sum += expf(src[j] - max);
+            }
+
+            // log probability of the best token within the shortlist
+            if (-log(sum) < wstate.vocab_shortlist_logprob_thold) {
+                fallback.push_back(i);
+                fallback.push_back(row);
+            }
+        }
+
+        auto & hidden_out = wstate.hidden;
+
+        hidden_out.resize(n_state*fallback.size()/2);
+        for (size_t f = 0; f < fallback.size()/2; ++f) {
+            ggml_backend_tensor_get(hidden, hidden_out.data() + n_state*f, hidden->nb[1]*fallback[2*f + 1], sizeof(float)*n_state);
+        }
+
+        ggml_backend_sched_reset(wstate.sched);
+
+        if (!fallback.empty()) {
+            auto & sched = wstate.sched;
+
+            const int n_rows = fallback.size()/2;
+
+            ggml_cgraph * gf = whisper_build_graph_logits(wctx, wstate, n_rows);
+
+            if (!ggml_backend_sched_alloc_graph(sched, gf)) {
+                return false;
+            }
+
+            ggml_backend_tensor_set(ggml_graph_get_tensor(gf, "hidden"), hidden_out.data(), 0, sizeof(float)*n_state*n_rows);
+
+            if (!ggml_graph_compute_helper(sched, gf, n_threads, false)) {
+                return false;
+            }
+
+            struct ggml_tensor * logits_full = ggml_graph_node(gf, -1);
+            for (int f = 0; f < n_rows; ++f) {
+                ggml_backend_tensor_get(logits_full, logits_out.data() + n_vocab*fallback[2*f], sizeof(float)*n_vocab*f, sizeof(float)*n_vocab);
+            }
+
+            ggml_backend_sched_reset(sched);
         }
-        ggml_backend_tensor_get(logits, logits_out.data() + (n_vocab*i), sizeof(float)*(n_vocab*i), sizeof(float)*n_vocab);
     }
 
     if (batch.n_tokens > 1) {
@@ -3376,6 +4183,83 @@ static std::string whisper_openvino_get_path_cache(std::string path_bin) {
 }
 #endif
 
+// low-memory mode: tell the kernel which pages of the mapping are needed soon and which ones can be dropped
+static void whisper_stream_advise(const whisper_model & model, int slot, bool need) {
+#if !defined(_WIN32)
+    if (slot < 0 || slot >= (int) model.stream_pages.size()) {
+        return;
+    }
+
+    const auto & pages = model.stream_pages[slot];
+    if (pages.first >= pages.second) {
+        return;
+    }
+
+    madvise((char *) model.mapping->addr + pages.first, pages.second - pages.first, need ? MADV_WILLNEED : MADV_DONTNEED);
+#else
+    GGML_UNUSED(model);
+    GGML_UNUSED(slot);
+    GGML_UNUSED(need);
+#endif
+}
+
+// low-memory mode: release the decoder layers once the decoding of a window is done
+static void whisper_stream_release_decoder(whisper_state & state) {
+    if (state.stream.model == nullptr) {
+        return;
+    }
+
+    const whisper_model & model = *state.stream.model;
+
+    for (int slot = model.hparams.n_audio_layer; slot < (int) model.stream_pages.size(); ++slot) {
+        whisper_stream_advise(model, slot, false);
+    }
+}
+
+// scheduler eval callback of the low-memory mode
+// the graph is cut into chunks at the first node that uses the weights of a layer: when the scheduler reaches it, the
+// next layers are paged in, and once the chunk is computed, the pages of the encoder layer before are released
+// the decoder layers are used again by every decoder step, so they stay mapped until the decoding of the window is done
+// (see whisper_stream_release_decoder)
+static bool whisper_stream_eval(ggml_tensor * t, bool ask, void * user_data) {
+    whisper_stream & stream = *(whisper_stream *) user_data;
+
+    const whisper_model & model = *stream.model;
+
+    if (!ask) {
+        if (stream.slot_done < model.hparams.n_audio_layer) {
+            whisper_stream_advise(model, stream.slot_done, false);
+        }
+        stream.slot_done = -1;
+
+        return true;
+    }
+
+    if (t->op != GGML_OP_MUL_MAT || t->src[0]->buffer != model.buffer_mapped) {
+        return false;
+    }
+
+    const auto it = model.stream_slot.find(t->src[0]);
+    if (it == model.stream_slot.end() || it->second == stream.slot_cur) {
+        return false;
+    }
+
+    const int slot = it->second;
+
+    // the next layer has been paged in already, unless the graph has jumped (e.g. a new graph starts)
+    for (int k = slot == stream.slot_cur + 1 ? WHISPER_STREAM_AHEAD : 0; k <= WHISPER_STREAM_AHEAD; ++k) {
+        whisper_stream_advise(model, slot + k, true);
+    }
+
+    if (stream.slot_cur >= 0 && (stream.slot_cur < slot || stream.slot_cur > slot + WHISPER_STREAM_AHEAD)) {
+        stream.slot_done = stream.slot_cur;
+    }
+
+    stream.slot_cur = slot;
+
+    return true;
+}
+
 struct whisper_state * whisper_init_state(whisper_context * ctx) {
     whisper_state * state = new whisper_state;
 
@@ -3471,12 +4355,50 @@ struct whisper_state * whisper_init_state(whisper_context * ctx) {
     state->decoders[0].logits.reserve   (ctx->vocab.n_vocab);
     state->decoders[0].logprobs.reserve (ctx->vocab.n_vocab);
     state->decoders[0].logits_id.reserve(ctx->model.hparams.n_vocab);
+    state->decoders[0].probs_cdf.reserve(ctx->vocab.n_vocab);
 
     state->decoders[0].rng = std::mt19937(0);
 
+    // encoder results
+    {
+        const auto & hparams = ctx->model.hparams;
+
+        state->embd_ctx_buf.resize(2*ggml_tensor_overhead());
+
+        struct ggml_init_params params = {
+            /*.mem_size   =*/ state->embd_ctx_buf.size(),
+            /*.mem_buffer =*/ state->embd_ctx_buf.data(),
+            /*.no_alloc   =*/ true,
+        };
+
+        struct ggml_context * ctx0 = ggml_init(params);
+
+        state->embd_conv = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, hparams.n_audio_state, hparams.n_audio_ctx);
+        state->embd_enc  = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, hparams.n_audio_state, hparams.n_audio_ctx);
+
+        state->embd_buffer = ggml_backend_alloc_ctx_tensors(ctx0, state->backends[0]);
+
+        ggml_free(ctx0);
+
+        if (!state->embd_buffer) {
+            WHISPER_LOG_ERROR("%s: failed to allocate memory for the encoder results\n", __func__);
+            whisper_free_state(state);
+            return nullptr;
+        }
+
+        WHISPER_LOG_INFO("%s: encoder results size = %7.2f MB\n", __func__, ggml_backend_buffer_get_size(state->embd_buffer) / 1e6);
+    }
+
+    state->sched = ggml_backend_sched_new(state->backends.data(), nullptr, state->backends.size(), WHISPER_MAX_NODES, false, true);
+
+    if (!ctx->model.stream_slot.empty()) {
+        state->stream.model = &ctx->model;
+        ggml_backend_sched_set_eval_callback(state->sched, whisper_stream_eval, &state->stream);
+    }
+
     // conv allocator
     {
-        bool ok = whisper_sched_graph_init(state->sched_conv, state->backends,
+        bool ok = whisper_sched_graph_reserve(state->sched, state->meta_conv,
                 [&]() {
                     return whisper_build_graph_conv(*ctx, *state);
                 });
@@ -3486,13 +4408,11 @@ struct whisper_state * whisper_init_state(whisper_context * ctx) {
             whisper_free_state(state);
             return nullptr;
         }
-
-        WHISPER_LOG_INFO("%s: compute buffer (conv)   = %7.2f MB\n", __func__, whisper_sched_size(state->sched_conv) / 1e6);
     }
 
     // encoder allocator
     if (!whisper_encode_external(*state)) {
-        bool ok = whisper_sched_graph_init(state->sched_encode, state->backends,
+        bool ok = whisper_sched_graph_reserve(state->sched, state->meta_encode,
                 [&]() {
                     return whisper_build_graph_encoder(*ctx, *state);
                 });
@@ -3502,13 +4422,11 @@ struct whisper_state * whisper_init_state(whisper_context * ctx) {
             whisper_free_state(state);
             return nullptr;
         }
-
-        WHISPER_LOG_INFO("%s: compute buffer (encode) = %7.2f MB\n", __func__, whisper_sched_size(state->sched_encode) / 1e6);
     }
 
     // cross allocator
     {
-        bool ok = whisper_sched_graph_init(state->sched_cross, state->backends,
+        bool ok = whisper_sched_graph_reserve(state->sched, state->meta_cross,
                 [&]() {
                     return whisper_build_graph_cross(*ctx, *state);
                 });
@@ -3518,13 +4436,11 @@ struct whisper_state * whisper_init_state(whisper_context * ctx) {
             whisper_free_state(state);
             return nullptr;
         }
-
-        WHISPER_LOG_INFO("%s: compute buffer (cross)  = %7.2f MB\n", __func__, whisper_sched_size(state->sched_cross) / 1e6);
     }
 
     // decoder allocator
     {
-        bool ok = whisper_sched_graph_init(state->sched_decode, state->backends,
+        bool ok = whisper_sched_graph_reserve(state->sched, state->meta_decode,
                 [&]() {
                     const auto & hparams = ctx->model.hparams;
 
@@ -3542,8 +4458,16 @@ struct whisper_state * whisper_init_state(whisper_context * ctx) {
             whisper_free_state(state);
             return nullptr;
         }
+    }
+
+    {
+        size_t size = 0;
+        for (int i = 0; i < ggml_backend_sched_get_n_backends(state->sched); ++i) {
+            ggml_backend_t backend = ggml_backend_sched_get_backend(state->sched, i);
+            size += ggml_backend_sched_get_buffer_size(state->sched, backend);
+        }
 
-        WHISPER_LOG_INFO("%s: compute buffer (decode) = %7.2f MB\n", __func__, whisper_sched_size(state->sched_decode) / 1e6);
+        WHISPER_LOG_INFO("%s: compute buffer (shared) = %7.2f MB\n", __func__, size / 1e6);
     }
 
     return state;
@@ -3622,6 +4546,9 @@ struct whisper_context_params whisper_context_default_params() {
             /*.heads            =*/ NULL,
         },
         /*.dtw_mem_size         =*/ 1024*1024*128,
+
+        /*.low_memory           =*/ false,
+        /*.type_kv              =*/ GGML_TYPE_F16,
     };
     return result;
 }
@@ -3641,9 +4568,39 @@ struct whisper_context * whisper_init_from_file_with_params_no_state(const char
         return nullptr;
     }
 
-    whisper_model_loader loader = {};
+    if (params.low_memory) {
+#if defined(_WIN32) || defined(WHISPER_BIG_ENDIAN)
+        WHISPER_LOG_WARN("%s: low_memory is not supported on this platform - loading the weights into memory\n", __func__);
+#else
+        whisper_mmap * mapping = whisper_mmap_init(path_model);
+        if (!mapping) {
+            return nullptr;
+        }
 
-    loader.context = &fin;
+        whisper_model_loader loader = {};
+
+        loader.context = mapping;
+        loader.read    = whisper_mmap_read;
+        loader.eof     = whisper_mmap_eof;
+        loader.close   = [](void * /*ctx*/) { };
+
+        auto ctx = whisper_init_with_params_no_state(&loader, params);
+
+        if (!ctx) {
+            whisper_mmap_free(mapping);
+            return nullptr;
+        }
+
+        ctx->model.mapping = mapping;
+        ctx->path_model    = path_model;
+
+        return ctx;
+#endif
+    }
+
+    whisper_model_loader loader = {};
+
+    loader.context = &fin;
 
     loader.read = [](void * ctx, void * output, size_t read_size) {
         std::ifstream * fin = (std::ifstream*)ctx;
@@ -3719,11 +4676,19 @@ struct whisper_context * whisper_init_with_params_no_state(struct whisper_model_
     WHISPER_LOG_INFO("%s: flash attn = %d\n", __func__, params.flash_attn);
     WHISPER_LOG_INFO("%s: gpu_device = %d\n", __func__, params.gpu_device);
     WHISPER_LOG_INFO("%s: dtw        = %d\n", __func__, params.dtw_token_timestamps);
+
+    if (params.type_kv != GGML_TYPE_F16 && params.type_kv != GGML_TYPE_BF16 && params.type_kv != GGML_TYPE_F32) {
+        WHISPER_LOG_WARN("%s: type_kv %s is not supported - using f16\n", __func__, ggml_type_name(params.type_kv));
+        params.type_kv = GGML_TYPE_F16;
+    }
+
+    WHISPER_LOG_INFO("%s: type_kv    = %s\n", __func__, ggml_type_name(params.type_kv));
     WHISPER_LOG_INFO("%s: devices    = %zu\n", __func__, ggml_backend_dev_count());
     WHISPER_LOG_INFO("%s: backends   = %zu\n", __func__, ggml_backend_reg_count());
 
     whisper_context * ctx = new whisper_context;
     ctx->params = params;
+    ctx->itype  = params.type_kv;
 
     if (!whisper_model_load(loader, *ctx)) {
         loader->close(loader->context);
@@ -3812,6 +4777,8 @@ void whisper_free_state(struct whisper_state * state) {
         whisper_kv_cache_free(state->kv_cross);
         whisper_kv_cache_free(state->kv_pad);
 
+        ggml_backend_buffer_free(state->mel_buffer);
+
 #ifdef WHISPER_USE_COREML
         if (state->ctx_coreml != nullptr) {
             whisper_coreml_free(state->ctx_coreml);
@@ -3828,10 +4795,11 @@ void whisper_free_state(struct whisper_state * state) {
 
         whisper_batch_free(state->batch);
 
-        ggml_backend_sched_free(state->sched_conv.sched);
-        ggml_backend_sched_free(state->sched_encode.sched);
-        ggml_backend_sched_free(state->sched_cross.sched);
-        ggml_backend_sched_free(state->sched_decode.sched);
+        whisper_state_set_threadpool(*state, 0, -1);
+
+        ggml_backend_sched_free(state->sched);
+
+        ggml_backend_buffer_free(state->embd_buffer);
 
         for (auto & backend : state->backends) {
             ggml_backend_free(backend);
@@ -3859,6 +4827,10 @@ void whisper_free(struct whisper_context * ctx) {
             ggml_backend_buffer_free(buf);
         }
 
+        whisper_mmap_free(ctx->model.mapping);
+
+        whisper_set_vocab_shortlist(ctx, nullptr, 0);
+
         whisper_free_state(ctx->state);
 
         delete ctx;
@@ -3942,7 +4914,15 @@ int whisper_decode_with_state(struct whisper_context * ctx, struct whisper_state
 
     whisper_kv_cache_seq_rm(state->kv_self, 0, n_past, -1);
 
-    if (!whisper_decode_internal(*ctx, *state, state->batch, n_threads, false, nullptr, nullptr)) {
+    // the logits of the full vocabulary, also when called from whisper_full with the shortlist
+    const bool vocab_shortlist = state->vocab_shortlist;
+    state->vocab_shortlist = false;
+
+    const bool ok = whisper_decode_internal(*ctx, *state, state->batch, n_threads, false, nullptr, nullptr);
+
+    state->vocab_shortlist = vocab_shortlist;
+
+    if (!ok) {
         WHISPER_LOG_ERROR("%s: failed to eval\n", __func__);
         return 1;
     }
@@ -3950,6 +4930,88 @@ int whisper_decode_with_state(struct whisper_context * ctx, struct whisper_state
     return 0;
 }
 
+int whisper_set_vocab_shortlist(struct whisper_context * ctx, const whisper_token * tokens, int n_tokens) {
+    auto & model = ctx->model;
+    auto & vocab = ctx->vocab;
+
+    if (model.ctx_short) {
+        ggml_free(model.ctx_short);
+        ggml_backend_buffer_free(model.buffer_short);
+
+        model.ctx_short    = nullptr;
+        model.buffer_short = nullptr;
+        model.d_te_short   = nullptr;
+        model.shortlist.clear();
+    }
+
+    if (tokens == nullptr || n_tokens <= 0) {
+        return 0;
+    }
+
+    const int n_vocab = model.hparams.n_vocab;
+
+    // the text tokens in ascending order, then the special and timestamp tokens
+    std::vector<whisper_token> shortlist;
+    for (int i = 0; i < n_tokens; ++i) {
+        if (tokens[i] < 0 || tokens[i] >= n_vocab) {
+            WHISPER_LOG_ERROR("%s: invalid token %d\n", __func__, tokens[i]);
+            return -1;
+        }
+        if (tokens[i] < vocab.token_eot) {
+            shortlist.push_back(tokens[i]);
+        }
+    }
+    std::sort(shortlist.begin(), shortlist.end());
+    shortlist.erase(std::unique(shortlist.begin(), shortlist.end()), shortlist.end());
+
+    for (whisper_token id = vocab.token_eot; id < n_vocab; ++id) {
+        shortlist.push_back(id);
+    }
+
+    struct ggml_init_params params = {
+        /*.mem_size   =*/ ggml_tensor_overhead(),
+        /*.mem_buffer =*/ nullptr,
+        /*.no_alloc   =*/ true,
+    };
+
+    model.ctx_short = ggml_init(params);
+
+    model.d_te_short = ggml_new_tensor_2d(model.ctx_short, model.d_te->type, model.d_te->ne[0], shortlist.size());
+    ggml_set_name(model.d_te_short, "decoder.token_embedding.shortlist");
+
+    model.buffer_short = ggml_backend_alloc_ctx_tensors_from_buft(model.ctx_short, ggml_backend_buffer_get_type(model.d_te->buffer));
+    if (!model.buffer_short) {
+        WHISPER_LOG_ERROR("%s: failed to allocate the shortlist\n", __func__);
+        ggml_free(model.ctx_short);
+        model.ctx_short  = nullptr;
+        model.d_te_short = nullptr;
+        return -1;
+    }
+
+    // copy the rows, consecutive tokens at once
+    const size_t nb1 = model.d_te->nb[1];
+
+    std::vector<uint8_t> buf;
+    for (size_t i0 = 0; i0 < shortlist.size(); ) {
+        size_t i1 = i0 + 1;
+        while (i1 < shortlist.size() && shortlist[i1] == shortlist[i1 - 1] + 1) {
+            i1++;
+        }
+
+        buf.resize(nb1*(i1 - i0));
+        ggml_backend_tensor_get(model.d_te,       buf.data(), nb1*shortlist[i0], buf.size());
+        ggml_backend_tensor_set(model.d_te_short, buf.data(), nb1*i0,            buf.size());
+
+        i0 = i1;
+    }
+
+    model.shortlist = std::move(shortlist);
+
+    WHISPER_LOG_INFO("%s: %d of %d tokens, %8.2f MB\n", __func__, (int) model.shortlist.size(), n_vocab, ggml_nbytes(model.d_te_short)/1e6);
+
+    return 0;
+}
+
 int whisper_decode(struct whisper_context * ctx, const whisper_token * tokens, int n_tokens, int n_past, int n_threads) {
     if (ctx->state == nullptr) {
         WHISPER_LOG_ERROR("%s: ERROR state was not loaded.\n", __func__);
@@ -4257,6 +5319,22 @@ struct whisper_timings * whisper_get_timings(struct whisper_context * ctx) {
     timings->decode_ms = 1e-3f * ctx->state->t_decode_us / std::max(1, ctx->state->n_decode);
     timings->batchd_ms = 1e-3f * ctx->state->t_batchd_us / std::max(1, ctx->state->n_batchd);
     timings->prompt_ms = 1e-3f * ctx->state->t_prompt_us / std::max(1, ctx->state->n_prompt);
+
+    const auto & hot = ctx->state->hot;
+
+    timings->logits_ms   = 1e-3f * hot[WHISPER_HOT_LOGITS ].t_us / std::max(1, (int) hot[WHISPER_HOT_LOGITS ].n);
+    timings->softmax_ms  = 1e-3f * hot[WHISPER_HOT_SOFTMAX].t_us / std::max(1, (int) hot[WHISPER_HOT_SOFTMAX].n);
+    timings->sampling_ms = 1e-3f * hot[WHISPER_HOT_SAMPLE ].t_us / std::max(1, (int) hot[WHISPER_HOT_SAMPLE ].n);
+    timings->beam_ms     = 1e-3f * hot[WHISPER_HOT_BEAM   ].t_us / std::max(1, (int) hot[WHISPER_HOT_BEAM   ].n);
+    timings->kv_ms       = 1e-3f * hot[WHISPER_HOT_KV     ].t_us / std::max(1, (int) hot[WHISPER_HOT_KV     ].n);
+    timings->segment_ms  = 1e-3f * hot[WHISPER_HOT_SEGMENT].t_us / std::max(1, (int) hot[WHISPER_HOT_SEGMENT].n);
+
+    timings->n_logits   = hot[WHISPER_HOT_LOGITS ].n;
+    timings->n_softmax  = hot[WHISPER_HOT_SOFTMAX].n;
+    timings->n_sampling = hot[WHISPER_HOT_SAMPLE ].n;
+    timings->n_beam     = hot[WHISPER_HOT_BEAM   ].n;
+    timings->n_kv       = hot[WHISPER_HOT_KV     ].n;
+    timings->n_segment  = hot[WHISPER_HOT_SEGMENT].n;
     return timings;
 }
 
@@ -4280,6 +5358,13 @@ void whisper_print_timings(struct whisper_context * ctx) {
         WHISPER_LOG_INFO("%s:   decode time = %8.2f ms / %5d runs ( %8.2f ms per run)\n", __func__, 1e-3f * ctx->state->t_decode_us, n_decode, 1e-3f * ctx->state->t_decode_us / n_decode);
         WHISPER_LOG_INFO("%s:   batchd time = %8.2f ms / %5d runs ( %8.2f ms per run)\n", __func__, 1e-3f * ctx->state->t_batchd_us, n_batchd, 1e-3f * ctx->state->t_batchd_us / n_batchd);
         WHISPER_LOG_INFO("%s:   prompt time = %8.2f ms / %5d runs ( %8.2f ms per run)\n", __func__, 1e-3f * ctx->state->t_prompt_us, n_prompt, 1e-3f * ctx->state->t_prompt_us / n_prompt);
+
+        static const char * hot_names[WHISPER_HOT_COUNT] = { "logits", "softmax", "sampling", "beam", "kv", "segment" };
+        for (int i = 0; i < WHISPER_HOT_COUNT; ++i) {
+            const int64_t t_us = ctx->state->hot[i].t_us;
+            const int32_t n    = std::max(1, (int) ctx->state->hot[i].n);
+            WHISPER_LOG_INFO("%s: %8s time = %8.2f ms / %5d runs ( %8.3f ms per run)\n", __func__, hot_names[i], 1e-3f * t_us, (int) ctx->state->hot[i].n, 1e-3f * t_us / n);
+        }
     }
     WHISPER_LOG_INFO("%s:    total time = %8.2f ms\n", __func__, (t_end_us - ctx->t_start_us)/1000.0f);
 }
@@ -4298,6 +5383,10 @@ void whisper_reset_timings(struct whisper_context * ctx) {
         ctx->state->n_decode = 0;
         ctx->state->n_batchd = 0;
         ctx->state->n_prompt = 0;
+        for (auto & hot : ctx->state->hot) {
+            hot.t_us = 0;
+            hot.n    = 0;
+        }
     }
 }
 
@@ -5913,6 +7002,9 @@ struct whisper_full_params whisper_full_default_params(enum whisper_sampling_str
         /*.strategy          =*/ strategy,
 
         /*.n_threads         =*/ std::min(4, (int32_t) std::thread::hardware_concurrency()),
+        /*.n_threads_encode  =*/ 0,
+        /*.n_threads_decode  =*/ 0,
+        /*.poll              =*/ -1,
         /*.n_max_text_ctx    =*/ 16384,
         /*.offset_ms         =*/ 0,
         /*.duration_ms       =*/ 0,
@@ -5992,8 +7084,22 @@ struct whisper_full_params whisper_full_default_params(enum whisper_sampling_str
 
         /*.vad                         =*/ false,
         /*.vad_model_path              =*/ nullptr,
+        /*.vad_schedule                =*/ false,
 
         /* vad_params =*/ whisper_vad_default_params(),
+
+        /*.scheduler             =*/ nullptr,
+        /*.scheduler_priority    =*/ 0,
+        /*.scheduler_deadline_ms =*/ 0,
+
+        /*.vocab_shortlist               =*/ false,
+        /*.vocab_shortlist_logprob_thold =*/ -1.0f,
+
+        /*.hotwords      =*/ nullptr,
+        /*.n_hotwords    =*/ 0,
+        /*.hotword_boost =*/ 2.0f,
+
+        /*.stream_offset_samples =*/ -1,
     };
 
     switch (strategy) {
@@ -6017,7 +7123,6 @@ struct whisper_full_params whisper_full_default_params(enum whisper_sampling_str
 }
 
 // forward declarations
-static std::vector<float> get_signal_energy(const float * signal, int n_samples, int n_samples_per_half_window);
 static void whisper_exp_compute_token_level_timestamps(
         struct whisper_context & ctx,
           struct whisper_state & state,
@@ -6043,17 +7148,42 @@ static void whisper_exp_compute_token_level_timestamps_dtw(
                                int   n_threads);
 
 // wrap the last segment to max_len characters
+// single pass over the tokens - the split points are found with a running text length and each token and
+// character is copied once into the resulting segments
 // returns the number of new segments
 static int whisper_wrap_segment(struct whisper_context & ctx, struct whisper_state & state, int max_len, bool split_on_word) {
-    auto segment = state.result_all.back();
+    whisper_segment segment = std::move(state.result_all.back());
+    state.result_all.pop_back();
+
+    auto & tokens = segment.tokens;
 
-    int res = 1;
+    const int n_tokens = tokens.size();
+
+    int res = 0;
     int acc = 0;
+    int i0  = 0;
+
+    int64_t t0 = segment.t0;
 
     std::string text;
 
-    for (int i = 0; i < (int) segment.tokens.size(); i++) {
-        const auto & token = segment.tokens[i];
+    // emit the tokens [i0, i1) as a new segment
+    // only the first segment keeps the no_speech_prob and only the last one the speaker turn
+    auto emit = [&](int i1, int64_t t1, bool last) {
+        state.result_all.push_back({ t0, t1, std::move(text), res == 0 ? segment.no_speech_prob : 0.0f, {}, last ? segment.speaker_turn_next : false });
+
+        if (last && i0 == 0) {
+            state.result_all.back().tokens = std::move(tokens);
+        } else {
+            state.result_all.back().tokens.assign(tokens.begin() + i0, tokens.begin() + i1);
+        }
+
+        text.clear();
+        res++;
+    };
+
+    for (int i = 0; i < n_tokens; i++) {
+        const auto & token = tokens[i];
         if (token.id >= whisper_token_eot(&ctx)) {
             continue;
         }
@@ -6061,38 +7191,19 @@ static int whisper_wrap_segment(struct whisper_context & ctx, struct whisper_sta
         const auto txt = whisper_token_to_str(&ctx, token.id);
         const int cur = strlen(txt);
 
-        if (acc + cur > max_len && i > 0 && should_split_on_word(txt, split_on_word)) {
-            state.result_all.back().text = std::move(text);
-            state.result_all.back().t1 = token.t0;
-            state.result_all.back().tokens.resize(i);
-            state.result_all.back().speaker_turn_next = false;
-
-            state.result_all.push_back({});
-            state.result_all.back().t0 = token.t0;
-            state.result_all.back().t1 = segment.t1;
-
-            // add tokens [i, end] to the new segment
-            state.result_all.back().tokens.insert(
-                state.result_all.back().tokens.end(),
-                    segment.tokens.begin() + i,
-                    segment.tokens.end());
-
-            state.result_all.back().speaker_turn_next = segment.speaker_turn_next;
+        if (acc + cur > max_len && i > i0 && should_split_on_word(txt, split_on_word)) {
+            emit(i, token.t0, false);
 
+            t0  = token.t0;
+            i0  = i;
             acc = 0;
-            text = "";
-
-            segment = state.result_all.back();
-            i = -1;
-
-            res++;
-        } else {
-            acc += cur;
-            text += txt;
         }
+
+        acc += cur;
+        text += txt;
     }
 
-    state.result_all.back().text = std::move(text);
+    emit(n_tokens, segment.t1, true);
 
     return res;
 }
@@ -6126,6 +7237,24 @@ static void whisper_compute_logprobs(
     }
 }
 
+// probability of a single token - same result as whisper_compute_logprobs + whisper_compute_probs, without
+// the [n_vocab] buffers
+static float whisper_compute_prob(
+                const std::vector<float> & logits,
+                              const int    n_logits,
+                          whisper_token    id) {
+    const float logit_max = *std::max_element(logits.begin(), logits.end());
+    float logsumexp = 0.0f;
+    for (int i = 0; i < n_logits; ++i) {
+        if (logits[i] > -INFINITY) {
+            logsumexp += expf(logits[i] - logit_max);
+        }
+    }
+    logsumexp = logf(logsumexp) + logit_max;
+
+    return logits[id] == -INFINITY ? 0.0f : expf(logits[id] - logsumexp);
+}
+
 static void whisper_compute_probs(
     const std::vector<float> & logits,
                   const int    n_logits,
@@ -6140,6 +7269,176 @@ static void whisper_compute_probs(
     }
 }
 
+// resolve the tokens suppressed by params.suppress_regex and params.suppress_nst
+// the result is cached in the state and only recomputed when these parameters change
+static void whisper_prepare_suppress(
+              struct whisper_context & ctx,
+               struct whisper_state  & state,
+    const struct whisper_full_params & params) {
+    const auto & vocab = ctx.vocab;
+
+    const std::string regex = params.suppress_regex ? params.suppress_regex : "";
+
+    if (state.suppress_ready && state.suppress_regex == regex && state.suppress_nst == params.suppress_nst) {
+        return;
+    }
+
+    auto & ids = state.suppress_ids;
+
+    ids.clear();
+
+    // suppress any tokens matching a regular expression
+    // ref: https://github.com/openai/whisper/discussions/1041
+    if (!regex.empty()) {
+        std::regex re(regex);
+        for (const auto & token_id : vocab.token_to_id) {
+            if (std::regex_match(token_id.first, re)) {
+                ids.push_back(token_id.second);
+            }
+        }
+    }
+
+    // suppress non-speech tokens
+    // ref: https://github.com/openai/whisper/blob/7858aa9c08d98f75575035ecd6481f462d66ca27/whisper/tokenizer.py#L224-L253
+    if (params.suppress_nst) {
+        for (const std::string & token : non_speech_tokens) {
+            const std::string suppress_tokens[] = {token, " " + token};
+            for (const std::string & suppress_token : suppress_tokens) {
+                if (vocab.token_to_id.find(suppress_token) != vocab.token_to_id.end()) {
+                    ids.push_back(vocab.token_to_id.at(suppress_token));
+                }
+            }
+        }
+
+        // allow hyphens "-" and single quotes "'" between words, but not at the beginning of a word
+        if (vocab.token_to_id.find(" -") != vocab.token_to_id.end()) {
+            ids.push_back(vocab.token_to_id.at(" -"));
+        }
+        if (vocab.token_to_id.find(" '") != vocab.token_to_id.end()) {
+            ids.push_back(vocab.token_to_id.at(" '"));
+        }
+    }
+
+    state.suppress_ready = true;
+    state.suppress_regex = regex;
+    state.suppress_nst   = params.suppress_nst;
+}
+
+static void whisper_prepare_hotwords(
+              struct whisper_context & ctx,
+               struct whisper_state  & state,
+    const struct whisper_full_params & params) {
+    std::vector<std::string> hotwords;
+    for (int i = 0; i < params.n_hotwords; ++i) {
+        if (params.hotwords[i] && params.hotwords[i][0] != '\0') {
+            hotwords.emplace_back(params.hotwords[i]);
+        }
+    }
+
+    if (!state.hotword_nodes.empty() && state.hotwords == hotwords) {
+        return;
+    }
+
+    // build the trie with maps, then flatten it
+    // a phrase is added with a leading space, as words in the middle of the text start with one, and without one
+    // under a separate root that is only used at the start of the text (see whisper_hotwords_at_start)
+    std::vector<std::map<whisper_token, int32_t>> trie(2);
+
+    for (const auto & hotword : hotwords) {
+        for (const int32_t root : { 0, 1 }) {
+            int32_t node = root;
+            for (const whisper_token token : tokenize(ctx.vocab, root == 0 ? " " + hotword : hotword)) {
+                auto it = trie[node].find(token);
+                if (it == trie[node].end()) {
+                    it = trie[node].emplace(token, (int32_t) trie.size()).first;
+                    trie.emplace_back();
+                }
+                node = it->second;
+            }
+        }
+    }
+
+    auto & nodes = state.hotword_nodes;
+    auto & edges = state.hotword_edges;
+
+    nodes.resize(trie.size());
+    edges.clear();
+
+    for (size_t i = 0; i < trie.size(); ++i) {
+        nodes[i].edge_begin = edges.size();
+        for (const auto & kv : trie[i]) {
+            edges.push_back({ kv.first, kv.second });
+        }
+        nodes[i].edge_end = edges.size();
+    }
+
+    auto & roots       = state.hotword_roots;
+    auto & roots_start = state.hotword_roots_start;
+
+    roots.clear();
+    for (const auto & kv : trie[0]) {
+        roots.push_back(kv.first);
+    }
+
+    roots_start = roots;
+    for (const auto & kv : trie[1]) {
+        roots_start.push_back(kv.first);
+    }
+    std::sort(roots_start.begin(), roots_start.end());
+    roots_start.erase(std::unique(roots_start.begin(), roots_start.end()), roots_start.end());
+
+    state.hotwords = std::move(hotwords);
+}
+
+// a phrase without a leading space can only start the text of a segment: right after the prompt or a timestamp
+// elsewhere its first token is usually a sub-word piece (e.g. "K" of "Kubernetes") that would be boosted inside words
+static bool whisper_hotwords_at_start(const whisper_context & ctx, const std::vector<whisper_token_data> & tokens, size_t n) {
+    return n == 0 || tokens[n - 1].id >= ctx.vocab.token_beg;
+}
+
+// child of the trie node for the token, or -1
+static int32_t whisper_hotword_child(const whisper_state & state, int32_t node, whisper_token token) {
+    const auto & n = state.hotword_nodes[node];
+
+    const auto begin = state.hotword_edges.begin() + n.edge_begin;
+    const auto end   = state.hotword_edges.begin() + n.edge_end;
+
+    const auto it = std::lower_bound(begin, end, token, [](const whisper_hotword_edge & e, whisper_token t) {
+        return e.token < t;
+    });
+
+    return it != end && it->token == token ? it->node : -1;
+}
+
+// advance the hotword prefixes of the decoder by the sampled token, the last one of tokens
+// every prefix either continues with the token or is dropped, and the token can start a new one
+static void whisper_hotwords_accept_token(const whisper_context & ctx, const whisper_state & state, std::vector<int32_t> & prefixes, const std::vector<whisper_token_data> & tokens) {
+    if (state.hotwords.empty()) {
+        return;
+    }
+
+    const whisper_token token = tokens.back().id;
+
+    size_t n = 0;
+    for (size_t i = 0; i < prefixes.size(); ++i) {
+        const int32_t child = whisper_hotword_child(state, prefixes[i], token);
+        if (child >= 0 && state.hotword_nodes[child].edge_begin < state.hotword_nodes[child].edge_end) {
+            prefixes[n++] = child;
+        }
+    }
+    prefixes.resize(n);
+
+    for (const int32_t root : { 0, 1 }) {
+        if (root == 1 && !whisper_hotwords_at_start(ctx, tokens, tokens.size() - 1)) {
+            continue;
+        }
+        const int32_t child = whisper_hotword_child(state, root, token);
+        if (child >= 0 && state.hotword_nodes[child].edge_begin < state.hotword_nodes[child].edge_end) {
+            prefixes.push_back(child);
+        }
+    }
+}
+
 // process the logits for the selected decoder
 // - applies logit filters
 // - computes logprobs and probs
@@ -6158,6 +7457,10 @@ static void whisper_process_logits(
 
     WHISPER_ASSERT(n_logits == ctx.vocab.n_vocab);
 
+    const int64_t t_start_us   = ggml_time_us();
+          int64_t t_grammar_us = 0;
+          int64_t t_filter_us  = 0;
+
     // extract the logits for the last token
     // we will be mutating, and therefore we don't want to use the ctx.logits buffer directly
     auto & probs    = decoder.probs;
@@ -6225,35 +7528,43 @@ static void whisper_process_logits(
             params.logits_filter_callback(&ctx, &state, tokens_cur.data(), tokens_cur.size(), logits.data(), params.logits_filter_callback_user_data);
         }
 
-        // suppress any tokens matching a regular expression
-        // ref: https://github.com/openai/whisper/discussions/1041
-        if (params.suppress_regex != nullptr) {
-            std::regex re(params.suppress_regex);
-            for (std::pair<whisper_vocab::token, whisper_vocab::id> token_id : vocab.token_to_id) {
-                if (std::regex_match(token_id.first, re)) {
-                    logits[token_id.second] = -INFINITY;
+        // suppress tokens matching params.suppress_regex and non-speech tokens (see whisper_prepare_suppress)
+        for (const whisper_token id : state.suppress_ids) {
+            logits[id] = -INFINITY;
+        }
+
+        // boost the tokens that start a hotword or continue one of the matched hotword prefixes, each token once
+        if (!state.hotwords.empty() && params.hotword_boost != 0.0f) {
+            const auto & roots = whisper_hotwords_at_start(ctx, tokens_cur, tokens_cur.size()) ? state.hotword_roots_start : state.hotword_roots;
+
+            for (const whisper_token id : roots) {
+                if (logits[id] > -INFINITY) {
+                    logits[id] += params.hotword_boost;
                 }
             }
-        }
 
-        // suppress non-speech tokens
-        // ref: https://github.com/openai/whisper/blob/7858aa9c08d98f75575035ecd6481f462d66ca27/whisper/tokenizer.py#L224-L253
-        if (params.suppress_nst) {
-            for (const std::string & token : non_speech_tokens) {
-                const std::string suppress_tokens[] = {token, " " + token};
-                for (const std::string & suppress_token : suppress_tokens) {
-                    if (vocab.token_to_id.find(suppress_token) != vocab.token_to_id.end()) {
-                        logits[vocab.token_to_id.at(suppress_token)] = -INFINITY;
+            // children of the active prefixes that are not boosted as the start of a phrase already
+            auto & boosted = decoder.hotword_tokens;
+            boosted.clear();
+
+            const auto & nodes = state.hotword_nodes;
+            const auto & edges = state.hotword_edges;
+
+            for (const int32_t node : decoder.hotword_prefixes) {
+                for (int32_t e = nodes[node].edge_begin; e < nodes[node].edge_end; ++e) {
+                    if (!std::binary_search(roots.begin(), roots.end(), edges[e].token)) {
+                        boosted.push_back(edges[e].token);
                     }
                 }
             }
 
-            // allow hyphens "-" and single quotes "'" between words, but not at the beginning of a word
-            if (vocab.token_to_id.find(" -") != vocab.token_to_id.end()) {
-                logits[vocab.token_to_id.at(" -")] = -INFINITY;
-            }
-            if (vocab.token_to_id.find(" '") != vocab.token_to_id.end()) {
-                logits[vocab.token_to_id.at(" '")] = -INFINITY;
+            std::sort(boosted.begin(), boosted.end());
+            boosted.erase(std::unique(boosted.begin(), boosted.end()), boosted.end());
+
+            for (const whisper_token id : boosted) {
+                if (logits[id] > -INFINITY) {
+                    logits[id] += params.hotword_boost;
+                }
             }
         }
 
@@ -6299,6 +7610,8 @@ static void whisper_process_logits(
             }
         }
 
+        t_filter_us = ggml_time_us();
+
         // populate the logprobs array (log_softmax)
         whisper_compute_logprobs(logits, n_logits, logprobs);
 
@@ -6331,8 +7644,12 @@ static void whisper_process_logits(
                 }
             } else {
                 if (params.n_grammar_rules > 0) {
+                    const int64_t t_grammar_start_us = ggml_time_us();
+
                     whisper_suppress_invalid_grammar(ctx, params, logits, decoder.grammar);
 
+                    t_grammar_us = ggml_time_us() - t_grammar_start_us;
+
                     // populate the logprobs array (log_softmax)
                     {
                         const float logit_max = *std::max_element(logits.begin(), logits.end());
@@ -6360,6 +7677,9 @@ static void whisper_process_logits(
     // compute probs
     whisper_compute_probs(logits, n_logits, logprobs, probs);
 
+    whisper_hot_add(state, WHISPER_HOT_LOGITS,  t_filter_us - t_start_us + t_grammar_us);
+    whisper_hot_add(state, WHISPER_HOT_SOFTMAX, ggml_time_us() - t_filter_us - t_grammar_us);
+
 #if 0
     // print first 100 logits - token string : logit
     //for (int i = 0; i < 10; i++) {
@@ -6427,6 +7747,33 @@ static bool whisper_sequence_tokens_equal(const whisper_sequence & a, const whis
     return true;
 }
 
+// sample an index with probability proportional to probs[i]
+// same algorithm as std::discrete_distribution, but reuses the cdf buffer instead of allocating one per call
+static int whisper_sample_discrete(
+    const std::vector<float> & probs,
+         std::vector<double> & cdf,
+                std::mt19937 & rng) {
+    const int n = probs.size();
+
+    double sum = 0.0;
+    for (int i = 0; i < n; ++i) {
+        sum += probs[i];
+    }
+
+    cdf.resize(n);
+
+    double acc = 0.0;
+    for (int i = 0; i < n; ++i) {
+        acc += probs[i]/sum;
+        cdf[i] = acc;
+    }
+    cdf[n - 1] = 1.0;
+
+    const double p = std::generate_canonical<double, std::numeric_limits<double>::digits>(rng);
+
+    return std::lower_bound(cdf.begin(), cdf.end(), p) - cdf.begin();
+}
+
 static whisper_token_data whisper_sample_token(
             whisper_context & ctx,
       const whisper_decoder & decoder,
@@ -6471,9 +7818,7 @@ static whisper_token_data whisper_sample_token(
             }
         }
     } else {
-        std::discrete_distribution<> dist(probs.begin(), probs.end());
-
-        result.id   = dist(decoder.rng);
+        result.id   = whisper_sample_discrete(probs, decoder.probs_cdf, decoder.rng);
         result.p    = probs[result.id];
         result.plog = logprobs[result.id];
     }
@@ -6486,10 +7831,11 @@ static whisper_token_data whisper_sample_token(
     return result;
 }
 
-static std::vector<whisper_token_data> whisper_sample_token_topk(
+static void whisper_sample_token_topk(
             whisper_context & ctx,
             whisper_decoder & decoder,
-                        int   k) {
+                        int   k,
+    std::vector<whisper_token_data> & result) {
     const auto & vocab = ctx.vocab;
 
     const auto & probs    = decoder.probs;
@@ -6516,7 +7862,7 @@ static std::vector<whisper_token_data> whisper_sample_token_topk(
         });
     }
 
-    std::vector<whisper_token_data> result;
+    result.clear();
     result.reserve(k);
 
     whisper_token tid = vocab.token_beg;
@@ -6544,10 +7890,8 @@ static std::vector<whisper_token_data> whisper_sample_token_topk(
         ptsum = sum_ts;
     }
 
-    std::discrete_distribution<> dist(probs.begin(), probs.end());
-
     for (int i = 0; i < k; ++i) {
-        const auto id = dist(decoder.rng);
+        const auto id = whisper_sample_discrete(probs, decoder.probs_cdf, decoder.rng);
         //printf("XXX %d %d %f %f %f %f\n", id, tid, probs[id], logprobs[id], pt, ptsum);
 
         result.push_back({ id, tid, probs[id], logprobs[id], pt, ptsum, -1, -1, -1, 0.0f, });
@@ -6557,8 +7901,6 @@ static std::vector<whisper_token_data> whisper_sample_token_topk(
             result[i].pt  = result[i].p;
         }
     }
-
-    return result;
 }
 
 // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L178-L192
@@ -6610,6 +7952,19 @@ static void whisper_sequence_score(
     }
 }
 
+static whisper_vad_context * whisper_vad_state_context(whisper_state * state, const whisper_full_params & params) {
+    if (state->vad_context == nullptr) {
+        struct whisper_vad_context_params vad_ctx_params = whisper_vad_default_context_params();
+        struct whisper_vad_context * vctx = whisper_vad_init_from_file_with_params(params.vad_model_path, vad_ctx_params);
+        if (vctx == nullptr) {
+            WHISPER_LOG_ERROR("%s: failed to initialize VAD context\n", __func__);
+            return nullptr;
+        }
+        state->vad_context = vctx;
+    }
+    return state->vad_context;
+}
+
 static bool whisper_vad(
         struct whisper_context * ctx,
           struct whisper_state * state,
@@ -6624,16 +7979,10 @@ static bool whisper_vad(
     state->vad_mapping_table.clear();
     state->has_vad_segments = false;
 
-    if (state->vad_context == nullptr) {
-        struct whisper_vad_context_params vad_ctx_params = whisper_vad_default_context_params();
-        struct whisper_vad_context * vctx = whisper_vad_init_from_file_with_params(params.vad_model_path, vad_ctx_params);
-        if (vctx == nullptr) {
-            WHISPER_LOG_ERROR("%s: failed to initialize VAD context\n", __func__);
-            return false;
-        }
-        state->vad_context = vctx;
+    auto vctx = whisper_vad_state_context(state, params);
+    if (vctx == nullptr) {
+        return false;
     }
-    auto vctx = state->vad_context;
 
     const whisper_vad_params & vad_params = params.vad_params;
 
@@ -6645,8 +7994,8 @@ static bool whisper_vad(
 
     if (vad_segments->data.size() > 0) {
         state->has_vad_segments = true;
-        ctx->state->vad_segments.clear();
-        ctx->state->vad_segments.reserve(vad_segments->data.size());
+        state->vad_segments.clear();
+        state->vad_segments.reserve(vad_segments->data.size());
 
         // Initialize the time mapping table
         state->vad_mapping_table.clear();
@@ -6741,7 +8090,7 @@ static bool whisper_vad(
 
                 WHISPER_LOG_INFO("%s: vad_segment_info: orig_start: %.2f, orig_end: %.2f, vad_start: %.2f, vad_end: %.2f\n",
                     __func__, segment.orig_start/100.0, segment.orig_end/100.0, segment.vad_start/100.0, segment.vad_end/100.0);
-                ctx->state->vad_segments.push_back(segment);
+                state->vad_segments.push_back(segment);
 
                 // Copy this speech segment
                 memcpy(filtered_samples.data() + offset, samples + segment_start_samples, segment_length * sizeof(float));
@@ -6794,50 +8143,380 @@ static bool whisper_vad(
     return true;
 }
 
-int whisper_full_with_state(
-        struct whisper_context * ctx,
+// a range of the original samples that is transcribed as a whole
+struct whisper_vad_window {
+    int i0;
+    int i1;
+};
+
+// turn the VAD speech segments into a schedule of windows over the original samples
+// consecutive segments are packed into the same window as long as it stays within 30 s, the window then also
+// covers the silence between them, so only the silence between windows is skipped
+static bool whisper_vad_schedule(
           struct whisper_state * state,
-    struct whisper_full_params   params,
+    const whisper_full_params  & params,
                    const float * samples,
-                           int   n_samples) {
-    // clear old results
-    auto & result_all = state->result_all;
+                           int   n_samples,
+    std::vector<whisper_vad_window> & windows) {
+    windows.clear();
 
-    result_all.clear();
+    state->vad_mapping_table.clear();
+    state->vad_segments.clear();
+    state->has_vad_segments = false;
 
-    if (n_samples > 0) {
-        // compute log mel spectrogram
-        if (whisper_pcm_to_mel_with_state(ctx, state, samples, n_samples, params.n_threads) != 0) {
-            WHISPER_LOG_ERROR("%s: failed to compute log mel spectrogram\n", __func__);
-            return -2;
-        }
+    auto vctx = whisper_vad_state_context(state, params);
+    if (vctx == nullptr) {
+        return false;
     }
 
-    // auto-detect language if not specified
-    if (params.language == nullptr || strlen(params.language) == 0 || strcmp(params.language, "auto") == 0 || params.detect_language) {
-        std::vector<float> probs(whisper_lang_max_id() + 1, 0.0f);
+    whisper_vad_segments * vad_segments = whisper_vad_segments_from_samples(vctx, params.vad_params, samples, n_samples);
+    if (!vad_segments) {
+        return false;
+    }
 
-        const auto lang_id = whisper_lang_auto_detect_with_state(ctx, state, 0, params.n_threads, probs.data());
-        if (lang_id < 0) {
-            WHISPER_LOG_ERROR("%s: failed to auto-detect language\n", __func__);
-            return -3;
+    const int n_window_max = WHISPER_CHUNK_SIZE*WHISPER_SAMPLE_RATE;
+    const int n_overlap    = params.vad_params.samples_overlap*WHISPER_SAMPLE_RATE;
+
+    // limit the schedule to [offset_ms, offset_ms + duration_ms)
+    // all boundaries are whole centiseconds (= mel frames), so the window timestamps can be shifted exactly
+    const int i_beg = std::min(n_samples, cs_to_samples(params.offset_ms/10));
+    const int i_end = params.duration_ms > 0 ? std::min(n_samples, i_beg + cs_to_samples(params.duration_ms/10)) : n_samples;
+
+    int n_speech = 0;
+
+    for (int i = 0; i < (int) vad_segments->data.size(); i++) {
+        int i0 = cs_to_samples(vad_segments->data[i].start);
+        int i1 = cs_to_samples(vad_segments->data[i].end);
+
+        if (i < (int) vad_segments->data.size() - 1) {
+            i1 += n_overlap;
         }
-        state->lang_id = lang_id;
-        params.language = whisper_lang_str(lang_id);
 
-        WHISPER_LOG_INFO("%s: auto-detected language: %s (p = %f)\n", __func__, params.language, probs[whisper_lang_id(params.language)]);
-        if (params.detect_language) {
-            return 0;
+        i0 = std::max(i0, i_beg);
+        i1 = std::min(i1, i_end);
+
+        if (i1 <= i0) {
+            continue;
         }
-    }
+
+        n_speech += i1 - i0;
+
+        if (!windows.empty() && i1 - windows.back().i0 <= n_window_max) {
+            windows.back().i1 = std::max(windows.back().i1, i1);
+        } else {
+            windows.push_back({ i0, i1 });
+        }
+    }
+
+    whisper_vad_free_segments(vad_segments);
+
+    int n_windowed = 0;
+    for (const auto & w : windows) {
+        n_windowed += w.i1 - w.i0;
+    }
+
+    WHISPER_LOG_INFO("%s: scheduled %d windows, %.2f s of %.2f s audio (%.2f s of speech)\n", __func__,
+            (int) windows.size(), (float) n_windowed/WHISPER_SAMPLE_RATE, (float) n_samples/WHISPER_SAMPLE_RATE,
+            (float) n_speech/WHISPER_SAMPLE_RATE);
+
+    return true;
+}
+
+struct whisper_vad_window_callback_data {
+    whisper_new_segment_callback callback;
+    void *                       user_data;
+    int64_t                      t_shift;
+    size_t                       n_shifted;
+};
+
+// move the segments [n_shifted, end) of the state to the original timeline
+static void whisper_vad_window_shift(whisper_state * state, whisper_vad_window_callback_data & data) {
+    for (size_t i = data.n_shifted; i < state->result_all.size(); ++i) {
+        auto & segment = state->result_all[i];
+
+        segment.t0 += data.t_shift;
+        segment.t1 += data.t_shift;
+
+        for (auto & token : segment.tokens) {
+            if (token.t0    >= 0) token.t0    += data.t_shift;
+            if (token.t1    >= 0) token.t1    += data.t_shift;
+            if (token.t_dtw >= 0) token.t_dtw += data.t_shift;
+        }
+    }
+
+    data.n_shifted = state->result_all.size();
+}
+
+static void whisper_vad_window_callback(struct whisper_context * ctx, struct whisper_state * state, int n_new, void * user_data) {
+    auto & data = *(whisper_vad_window_callback_data *) user_data;
+
+    whisper_vad_window_shift(state, data);
+
+    if (data.callback) {
+        data.callback(ctx, state, n_new, data.user_data);
+    }
+}
+
+// transcribe the windows [w0, w1) of the schedule with the given state
+// the segments are shifted to the original timeline before they reach the new segment callback
+// while a window is transcribed, the state only holds the segments of that window, so the segment indices seen by the
+// new segment callback are relative to the window; all the segments are in the state once the call returns
+// on failure, the state holds the segments of the windows before the failing one and its partial segments
+static int whisper_full_vad_windows(
+        struct whisper_context * ctx,
+          struct whisper_state * state,
+    struct whisper_full_params   params,
+                   const float * samples,
+    const std::vector<whisper_vad_window> & windows,
+                           int   w0,
+                           int   w1) {
+    std::vector<whisper_segment> result;
+
+    whisper_vad_window_callback_data data = { params.new_segment_callback, params.new_segment_callback_user_data, 0, 0 };
+
+    auto progress_callback           = params.progress_callback;
+    auto progress_callback_user_data = params.progress_callback_user_data;
+
+    params.offset_ms   = 0;
+    params.duration_ms = 0;
+
+    params.new_segment_callback           = whisper_vad_window_callback;
+    params.new_segment_callback_user_data = &data;
+
+    params.progress_callback           = nullptr;
+    params.progress_callback_user_data = nullptr;
+
+    for (int w = w0; w < w1; ++w) {
+        if (progress_callback) {
+            progress_callback(ctx, state, (100*(w - w0))/(w1 - w0), progress_callback_user_data);
+        }
+
+        data.t_shift   = samples_to_cs(windows[w].i0);
+        data.n_shifted = 0;
+
+        const int ret = whisper_full_with_state(ctx, state, params, samples + windows[w].i0, windows[w].i1 - windows[w].i0);
+
+        whisper_vad_window_shift(state, data);
+
+        for (auto & segment : state->result_all) {
+            result.push_back(std::move(segment));
+        }
+
+        if (ret != 0) {
+            state->result_all = std::move(result);
+            return ret;
+        }
+    }
+
+    state->result_all = std::move(result);
+
+    if (progress_callback) {
+        progress_callback(ctx, state, 100, progress_callback_user_data);
+    }
+
+    return 0;
+}
+
+//
+// scheduler
+//
+
+struct whisper_scheduler_job {
+    int     priority;
+    int64_t deadline_us; // absolute, INT64_MAX if none
+    int64_t seq;         // order of arrival
+    int     n_want;      // threads asked for by the next or current graph, 0 between graphs
+};
+
+struct whisper_scheduler {
+    std::mutex              mutex;
+    std::condition_variable cv;
+
+    int     n_threads = 1;
+    int64_t seq       = 0;
+
+    std::vector<whisper_scheduler_job *> jobs;
+};
+
+whisper_scheduler * whisper_scheduler_init(int n_threads) {
+    whisper_scheduler * scheduler = new whisper_scheduler;
+    scheduler->n_threads = n_threads > 0 ? n_threads : std::max(1, (int) std::thread::hardware_concurrency());
+    return scheduler;
+}
+
+void whisper_scheduler_free(whisper_scheduler * scheduler) {
+    if (scheduler == nullptr) {
+        return;
+    }
+    GGML_ASSERT(scheduler->jobs.empty() && "whisper_scheduler_free called while whisper_full is running with it");
+    delete scheduler;
+}
+
+// threads of the job when the budget is handed out by priority, then deadline, then arrival
+// must be called with the mutex held
+static int whisper_scheduler_share(const whisper_scheduler & scheduler, const whisper_scheduler_job & job) {
+    int n_free = scheduler.n_threads;
+
+    // every job that goes before this one takes its threads first
+    for (const auto * other : scheduler.jobs) {
+        if (other == &job) {
+            continue;
+        }
+        const bool before =
+            other->priority != job.priority ? other->priority > job.priority :
+            other->deadline_us != job.deadline_us ? other->deadline_us < job.deadline_us :
+            other->seq < job.seq;
+        if (before) {
+            n_free -= std::min(other->n_want, scheduler.n_threads);
+        }
+    }
+
+    return std::max(0, std::min(job.n_want, n_free));
+}
+
+// registers a whisper_full call with the scheduler of its params for as long as it runs
+struct whisper_scheduler_guard {
+    whisper_scheduler *   scheduler;
+    whisper_scheduler_job job;
+
+    whisper_scheduler_guard(const whisper_full_params & params) : scheduler(params.scheduler) {
+        if (scheduler == nullptr) {
+            return;
+        }
+
+        job.priority    = params.scheduler_priority;
+        job.deadline_us = params.scheduler_deadline_ms > 0 ? ggml_time_us() + 1000ll*params.scheduler_deadline_ms : INT64_MAX;
+        job.n_want      = 0;
+
+        std::lock_guard<std::mutex> lock(scheduler->mutex);
+        job.seq = scheduler->seq++;
+        scheduler->jobs.push_back(&job);
+    }
+
+    ~whisper_scheduler_guard() {
+        if (scheduler == nullptr) {
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(scheduler->mutex);
+            scheduler->jobs.erase(std::find(scheduler->jobs.begin(), scheduler->jobs.end(), &job));
+        }
+        scheduler->cv.notify_all();
+    }
+
+    // called before every window and every decoder step, returns the number of threads for the next graph
+    // waits while jobs that go first use all the threads
+    int acquire(int n_want) {
+        if (scheduler == nullptr) {
+            return n_want;
+        }
+
+        std::unique_lock<std::mutex> lock(scheduler->mutex);
+
+        // asking for fewer threads can let a waiting job run
+        const bool notify = n_want < job.n_want;
+
+        job.n_want = n_want;
+
+        int n_threads = 0;
+        scheduler->cv.wait(lock, [&]() {
+            n_threads = whisper_scheduler_share(*scheduler, job);
+            return n_threads > 0;
+        });
+
+        lock.unlock();
+
+        if (notify) {
+            scheduler->cv.notify_all();
+        }
+
+        return n_threads;
+    }
+
+    // called once the graph is done, the threads are free for the other jobs until the next acquire
+    // (sampling and the other CPU-side work between the graphs run on the calling thread only)
+    void release() {
+        if (scheduler == nullptr) {
+            return;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(scheduler->mutex);
+            job.n_want = 0;
+        }
+        scheduler->cv.notify_all();
+    }
+};
+
+int whisper_full_with_state(
+        struct whisper_context * ctx,
+          struct whisper_state * state,
+    struct whisper_full_params   params,
+                   const float * samples,
+                           int   n_samples) {
+    // clear old results
+    auto & result_all = state->result_all;
+
+    result_all.clear();
+
+    const int n_threads_encode = params.n_threads_encode > 0 ? params.n_threads_encode : params.n_threads;
+    const int n_threads_decode = params.n_threads_decode > 0 ? params.n_threads_decode : params.n_threads;
+
+    whisper_scheduler_guard scheduler(params);
+
+    state->vocab_shortlist               = params.vocab_shortlist && ctx->model.d_te_short != nullptr;
+    state->vocab_shortlist_logprob_thold = params.vocab_shortlist_logprob_thold;
+
+    whisper_state_set_threadpool(*state, std::max(n_threads_encode, n_threads_decode), params.poll);
+
+    whisper_prepare_suppress(*ctx, *state, params);
+    whisper_prepare_hotwords(*ctx, *state, params);
+
+    // VAD without the in-place schedule transcribes a new buffer, which is not at the stream offset
+    const bool is_stream = params.stream_offset_samples >= 0 && params.stream_offset_samples % WHISPER_HOP_LENGTH == 0 && (!params.vad || params.vad_schedule);
+
+    state->mel_frame0 = is_stream ? params.stream_offset_samples/WHISPER_HOP_LENGTH : -1;
+
+    if (n_samples > 0) {
+        // compute log mel spectrogram
+        if (whisper_pcm_to_mel_with_state(ctx, state, samples, n_samples, params.n_threads) != 0) {
+            WHISPER_LOG_ERROR("%s: failed to compute log mel spectrogram\n", __func__);
+            return -2;
+        }
+    }
+
+    // auto-detect language if not specified
+    if (params.language == nullptr || strlen(params.language) == 0 || strcmp(params.language, "auto") == 0 || params.detect_language) {
+        std::vector<float> probs(whisper_lang_max_id() + 1, 0.0f);
+
+        // an encoder and a decoder graph, the same budget as the encoder of the windows
+        const auto lang_id = whisper_lang_auto_detect_with_state(ctx, state, 0, scheduler.acquire(n_threads_encode), probs.data());
+        scheduler.release();
+
+        if (lang_id < 0) {
+            WHISPER_LOG_ERROR("%s: failed to auto-detect language\n", __func__);
+            return -3;
+        }
+        state->lang_id = lang_id;
+        params.language = whisper_lang_str(lang_id);
+
+        WHISPER_LOG_INFO("%s: auto-detected language: %s (p = %f)\n", __func__, params.language, probs[whisper_lang_id(params.language)]);
+        if (params.detect_language) {
+            return 0;
+        }
+    }
 
     if (params.token_timestamps) {
         state->t_beg    = 0;
         state->t_last   = 0;
         state->tid_last = 0;
-        if (n_samples > 0) {
-            state->energy = get_signal_energy(samples, n_samples, 32);
-        }
+
+        state->energy_pcm   = samples;
+        state->energy_n_pcm = std::max(0, n_samples);
+        state->energy_b0    = 0;
+        state->energy_sum.clear();
+        state->energy_sum2.clear();
     }
 
     const int seek_start = params.offset_ms/10;
@@ -6886,6 +8565,10 @@ int whisper_full_with_state(
     }
 
     // TAGS: WHISPER_DECODER_INIT
+    // reseed the first decoder as well - beam search samples candidates from it even at t = 0.0, so without
+    // this repeated calls on the same state would not produce the same results
+    state->decoders[0].rng = std::mt19937(0);
+
     for (int j = 1; j < n_decoders; j++) {
         auto & decoder = state->decoders[j];
 
@@ -6895,6 +8578,7 @@ int whisper_full_with_state(
         decoder.logits.resize  (ctx->vocab.n_vocab);
         decoder.logprobs.resize(ctx->vocab.n_vocab);
         decoder.logits_id.reserve(ctx->model.hparams.n_vocab);
+        decoder.probs_cdf.reserve(ctx->vocab.n_vocab);
 
         decoder.rng = std::mt19937(j);
     }
@@ -6953,6 +8637,7 @@ int whisper_full_with_state(
         WHISPER_LOG_ERROR("%s: audio_ctx is larger than the maximum allowed (%d > %d)\n", __func__, params.audio_ctx, whisper_n_audio_ctx(ctx));
         return -5;
     }
+
     state->exp_n_audio_ctx = params.audio_ctx;
 
     // these tokens determine the task that will be performed
@@ -6995,10 +8680,24 @@ int whisper_full_with_state(
 
         whisper_sequence sequence;
         whisper_grammar grammar;
+
+        std::vector<int32_t> hotword_prefixes;
     };
 
+    // the candidates are overwritten in place on every step, so that their token buffers are allocated once
     std::vector<std::vector<beam_candidate>> bc_per_dec(n_decoders);
-    std::vector<beam_candidate> beam_candidates;
+    std::vector<int>                         bc_per_dec_n(n_decoders, 0);
+    std::vector<beam_candidate *>            beam_candidates;
+
+    if (params.strategy == whisper_sampling_strategy::WHISPER_SAMPLING_BEAM_SEARCH) {
+        for (auto & bc : bc_per_dec) {
+            bc.resize(params.beam_search.beam_size);
+            for (auto & c : bc) {
+                c.sequence.tokens.reserve(state->decoders[0].sequence.tokens.capacity());
+            }
+        }
+        beam_candidates.reserve(n_decoders*params.beam_search.beam_size);
+    }
 
     // main loop
     while (true) {
@@ -7022,11 +8721,13 @@ int whisper_full_with_state(
         }
 
         // encode audio features starting at offset seek
-        if (!whisper_encode_internal(*ctx, *state, seek, params.n_threads, params.abort_callback, params.abort_callback_user_data)) {
+        if (!whisper_encode_internal(*ctx, *state, seek, scheduler.acquire(n_threads_encode), params.abort_callback, params.abort_callback_user_data)) {
             WHISPER_LOG_ERROR("%s: failed to encode\n", __func__);
             return -6;
         }
 
+        scheduler.release();
+
         // if there is a very short audio segment left to process, we remove any past prompt since it tends
         // to confuse the decoder and often make it repeat or hallucinate stuff
         if (seek > seek_start && seek + 500 >= seek_end) {
@@ -7085,6 +8786,8 @@ int whisper_full_with_state(
                 } else {
                     decoder.grammar = {};
                 }
+
+                decoder.hotword_prefixes.clear();
             }
 
             // init prompt and kv cache for the current iteration
@@ -7148,21 +8851,21 @@ int whisper_full_with_state(
 
                 whisper_batch_prep_legacy(state->batch, prompt.data(), prompt.size(), 0, 0);
 
-                if (!whisper_decode_internal(*ctx, *state, state->batch, params.n_threads, false, params.abort_callback, params.abort_callback_user_data)) {
+                if (!whisper_decode_internal(*ctx, *state, state->batch, scheduler.acquire(n_threads_decode), false, params.abort_callback, params.abort_callback_user_data)) {
                     WHISPER_LOG_ERROR("%s: failed to decode\n", __func__);
                     return -8;
                 }
 
+                scheduler.release();
+
                 // Calculate no_speech probability after first decode.
                 // This has to be done before any logit filtering. Hence we cannot use the probs from the whisper_process_logits.
                 {
+                    whisper_hot_timer timer(*state, WHISPER_HOT_SOFTMAX);
+
                     const int n_logits = ctx->vocab.id_to_token.size();
-                    std::vector<float> logprobs(n_logits);
-                    std::vector<float> probs(n_logits);
 
-                    whisper_compute_logprobs(state->logits, n_logits, logprobs);
-                    whisper_compute_probs(state->logits, n_logits, logprobs, probs);
-                    state->no_speech_prob = probs[whisper_token_nosp(ctx)];
+                    state->no_speech_prob = whisper_compute_prob(state->logits, n_logits, whisper_token_nosp(ctx));
                 }
 
                 {
@@ -7175,7 +8878,12 @@ int whisper_full_with_state(
                     for (int j = 1; j < n_decoders_cur; ++j) {
                         auto & decoder = state->decoders[j];
 
-                        whisper_kv_cache_seq_cp(state->kv_self, 0, j, -1, -1);
+                        {
+                            whisper_hot_timer timer(*state, WHISPER_HOT_KV);
+                            whisper_kv_cache_seq_cp(state->kv_self, 0, j, -1, -1);
+                        }
+
+                        whisper_hot_timer timer(*state, WHISPER_HOT_BEAM);
 
                         memcpy(decoder.probs.data(),    state->decoders[0].probs.data(),    decoder.probs.size()*sizeof(decoder.probs[0]));
                         memcpy(decoder.logits.data(),   state->decoders[0].logits.data(),   decoder.logits.size()*sizeof(decoder.logits[0]));
@@ -7186,14 +8894,14 @@ int whisper_full_with_state(
                 }
             }
 
+            const int64_t n_alloc_start = whisper_alloc_count();
+
             for (int i = 0, n_max = whisper_n_text_ctx(ctx)/2 - 4; i < n_max; ++i) {
                 const int64_t t_start_sample_us = ggml_time_us();
 
-                if (params.strategy == whisper_sampling_strategy::WHISPER_SAMPLING_BEAM_SEARCH) {
-                    for (auto & bc : bc_per_dec) {
-                        bc.clear();
-                    }
-                }
+                state->n_decode_steps++;
+
+                std::fill(bc_per_dec_n.begin(), bc_per_dec_n.end(), 0);
 
                 // sampling
                 // TODO: avoid memory allocations, optimize, avoid threads?
@@ -7217,6 +8925,8 @@ int whisper_full_with_state(
                             switch (params.strategy) {
                                 case whisper_sampling_strategy::WHISPER_SAMPLING_GREEDY:
                                     {
+                                        whisper_hot_timer timer(*state, WHISPER_HOT_SAMPLE);
+
                                         if (t_cur < 1e-6f) {
                                             decoder.sequence.tokens.push_back(whisper_sample_token(*ctx, decoder, true));
                                         } else {
@@ -7227,12 +8937,31 @@ int whisper_full_with_state(
                                     } break;
                                 case whisper_sampling_strategy::WHISPER_SAMPLING_BEAM_SEARCH:
                                     {
-                                        const auto tokens_new = whisper_sample_token_topk(*ctx, decoder, params.beam_search.beam_size);
+                                        auto & tokens_new = decoder.tokens_topk;
+                                        {
+                                            whisper_hot_timer timer(*state, WHISPER_HOT_SAMPLE);
+                                            whisper_sample_token_topk(*ctx, decoder, params.beam_search.beam_size, tokens_new);
+                                        }
+
+                                        whisper_hot_timer timer(*state, WHISPER_HOT_BEAM);
 
                                         for (const auto & token : tokens_new) {
-                                            bc_per_dec[j].push_back({ j, decoder.seek_delta, decoder.has_ts, decoder.sequence, decoder.grammar, });
-                                            bc_per_dec[j].back().sequence.tokens.push_back(token);
-                                            bc_per_dec[j].back().sequence.sum_logprobs_all += token.plog;
+                                            if (bc_per_dec_n[j] == (int) bc_per_dec[j].size()) {
+                                                bc_per_dec[j].emplace_back();
+                                            }
+
+                                            auto & bc = bc_per_dec[j][bc_per_dec_n[j]++];
+
+                                            bc.decoder_idx = j;
+                                            bc.seek_delta  = decoder.seek_delta;
+                                            bc.has_ts      = decoder.has_ts;
+                                            bc.sequence    = decoder.sequence;
+                                            bc.grammar     = decoder.grammar;
+
+                                            bc.hotword_prefixes = decoder.hotword_prefixes;
+
+                                            bc.sequence.tokens.push_back(token);
+                                            bc.sequence.sum_logprobs_all += token.plog;
                                         }
                                     } break;
                             };
@@ -7259,24 +8988,29 @@ int whisper_full_with_state(
                 }
 
                 beam_candidates.clear();
-                for (const auto & bc : bc_per_dec) {
-                    beam_candidates.insert(beam_candidates.end(), bc.begin(), bc.end());
+                for (int j = 0; j < (int) bc_per_dec.size(); ++j) {
+                    for (int k = 0; k < bc_per_dec_n[j]; ++k) {
+                        beam_candidates.push_back(&bc_per_dec[j][k]);
+                    }
 
-                    if (!bc.empty()) {
+                    if (bc_per_dec_n[j] > 0) {
                         state->n_sample += 1;
                     }
                 }
 
                 // for beam-search, choose the top candidates and update the KV caches
                 if (params.strategy == whisper_sampling_strategy::WHISPER_SAMPLING_BEAM_SEARCH) {
+                    const int64_t t_beam_start_us = ggml_time_us();
+                          int64_t t_kv_us         = 0;
+
                     std::sort(
                             beam_candidates.begin(),
                             beam_candidates.end(),
-                            [](const beam_candidate & a, const beam_candidate & b) {
-                        if (a.sequence.sum_logprobs_all != b.sequence.sum_logprobs_all) {
-                            return a.sequence.sum_logprobs_all > b.sequence.sum_logprobs_all;
+                            [](const beam_candidate * a, const beam_candidate * b) {
+                        if (a->sequence.sum_logprobs_all != b->sequence.sum_logprobs_all) {
+                            return a->sequence.sum_logprobs_all > b->sequence.sum_logprobs_all;
                         }
-                        return a.decoder_idx < b.decoder_idx;
+                        return a->decoder_idx < b->decoder_idx;
                     });
 
                     uint32_t cur_c = 0;
@@ -7292,9 +9026,9 @@ int whisper_full_with_state(
                             cur_c = 0;
                         }
 
-                        auto & cur = beam_candidates[cur_c++];
+                        auto & cur = *beam_candidates[cur_c++];
 
-                        while (beam_candidates.size() > cur_c && whisper_sequence_tokens_equal(beam_candidates[cur_c].sequence, cur.sequence) && i > 0) {
+                        while (beam_candidates.size() > cur_c && whisper_sequence_tokens_equal(beam_candidates[cur_c]->sequence, cur.sequence) && i > 0) {
                             ++cur_c;
                         }
 
@@ -7303,12 +9037,20 @@ int whisper_full_with_state(
                         decoder.sequence   = cur.sequence;
                         decoder.grammar    = cur.grammar;
 
+                        decoder.hotword_prefixes = cur.hotword_prefixes;
+
+                        const int64_t t_kv_start_us = ggml_time_us();
                         whisper_kv_cache_seq_cp(state->kv_self, cur.decoder_idx, WHISPER_MAX_DECODERS + j, -1, -1);
+                        t_kv_us += ggml_time_us() - t_kv_start_us;
 
                         WHISPER_LOG_DEBUG("%s: beam search: decoder %d: from decoder %d: token = %10s, plog = %8.5f, sum_logprobs = %8.5f\n",
                                 __func__, j, cur.decoder_idx, ctx->vocab.id_to_token.at(decoder.sequence.tokens.back().id).c_str(), decoder.sequence.tokens.back().plog, decoder.sequence.sum_logprobs_all);
                     }
 
+                    whisper_hot_add(*state, WHISPER_HOT_BEAM, ggml_time_us() - t_beam_start_us - t_kv_us);
+
+                    const int64_t t_kv_start_us = ggml_time_us();
+
                     for (int j = 0; j < n_decoders_cur; ++j) {
                         auto & decoder = state->decoders[j];
 
@@ -7320,6 +9062,8 @@ int whisper_full_with_state(
                         whisper_kv_cache_seq_cp(state->kv_self, WHISPER_MAX_DECODERS + j, j, -1, -1);
                         whisper_kv_cache_seq_rm(state->kv_self, WHISPER_MAX_DECODERS + j,    -1, -1);
                     }
+
+                    whisper_hot_add(*state, WHISPER_HOT_KV, ggml_time_us() - t_kv_start_us + t_kv_us);
                 }
 
                 // update the decoder state
@@ -7359,6 +9103,7 @@ int whisper_full_with_state(
                         }
 
                         whisper_grammar_accept_token(*ctx, decoder.grammar, token.id);
+                        whisper_hotwords_accept_token(*ctx, *state, decoder.hotword_prefixes, decoder.sequence.tokens);
 
 #ifdef WHISPER_DEBUG
                         {
@@ -7460,11 +9205,13 @@ int whisper_full_with_state(
 
                     assert(batch.n_tokens > 0);
 
-                    if (!whisper_decode_internal(*ctx, *state, state->batch, params.n_threads, false, params.abort_callback, params.abort_callback_user_data)) {
+                    if (!whisper_decode_internal(*ctx, *state, state->batch, scheduler.acquire(n_threads_decode), false, params.abort_callback, params.abort_callback_user_data)) {
                         WHISPER_LOG_ERROR("%s: failed to decode\n", __func__);
                         return -9;
                     }
 
+                    scheduler.release();
+
                     const int64_t t_start_sample_us = ggml_time_us();
 
                     // TODO: avoid memory allocations, optimize, avoid threads?
@@ -7512,6 +9259,8 @@ int whisper_full_with_state(
                 }
             }
 
+            state->n_alloc_decode += whisper_alloc_count() - n_alloc_start;
+
             // rank the resulting sequences and select the best one
             {
                 double best_score = -INFINITY;
@@ -7575,8 +9324,20 @@ int whisper_full_with_state(
             WHISPER_LOG_DEBUG("\n%s: failed to decode with temperature = %.2f\n", __func__, t_cur);
         }
 
+        whisper_stream_release_decoder(*state);
+
         // output results through a user-provided callback
         {
+            // the user callback is not part of the segment extraction time
+            const int64_t t_segment_start_us = ggml_time_us();
+                  int64_t t_callback_us      = 0;
+
+            auto new_segment_callback = [&](int n_new) {
+                const int64_t t_callback_start_us = ggml_time_us();
+                params.new_segment_callback(ctx, state, n_new, params.new_segment_callback_user_data);
+                t_callback_us += ggml_time_us() - t_callback_start_us;
+            };
+
             const auto & best_decoder = state->decoders[best_decoder_id];
 
             auto seek_delta = best_decoder.seek_delta;
@@ -7660,7 +9421,7 @@ int whisper_full_with_state(
                                 }
                             }
                             if (params.new_segment_callback && !ctx->params.dtw_token_timestamps) {
-                                params.new_segment_callback(ctx, state, n_new, params.new_segment_callback_user_data);
+                                new_segment_callback(n_new);
                             }
                         }
                         text = "";
@@ -7705,7 +9466,7 @@ int whisper_full_with_state(
                         }
                     }
                     if (params.new_segment_callback && !ctx->params.dtw_token_timestamps) {
-                        params.new_segment_callback(ctx, state, n_new, params.new_segment_callback_user_data);
+                        new_segment_callback(n_new);
                     }
                 }
             }
@@ -7720,7 +9481,7 @@ int whisper_full_with_state(
                             ctx, state, params, result_all.size() - n_segments, n_segments, seek, n_frames, 7, params.n_threads);
                     if (params.new_segment_callback) {
                         for (int seg = (int) result_all.size() - n_segments; seg < n_segments; seg++) {
-                            params.new_segment_callback(ctx, state, seg, params.new_segment_callback_user_data);
+                            new_segment_callback(seg);
                         }
                     }
                 }
@@ -7735,6 +9496,8 @@ int whisper_full_with_state(
                 seek_delta = std::min(seek_end - seek, WHISPER_CHUNK_SIZE * 100);
             }
 
+            whisper_hot_add(*state, WHISPER_HOT_SEGMENT, ggml_time_us() - t_segment_start_us - t_callback_us);
+
             // update audio window
             seek += seek_delta;
 
@@ -7742,78 +9505,127 @@ int whisper_full_with_state(
         }
     }
 
+    // the energy window points into the samples of this call
+    state->energy_pcm   = nullptr;
+    state->energy_n_pcm = 0;
+    std::vector<double>().swap(state->energy_sum);
+    std::vector<double>().swap(state->energy_sum2);
+
     return 0;
 }
 
-int whisper_full(
+// whisper_full_with_state() preceded by the VAD step of params (filtered samples or a schedule of windows)
+static int whisper_full_vad_with_state(
         struct whisper_context * ctx,
+          struct whisper_state * state,
     struct whisper_full_params   params,
                    const float * samples,
                            int   n_samples) {
 
+    if (params.vad && params.vad_schedule) {
+        std::vector<whisper_vad_window> windows;
+        if (!whisper_vad_schedule(state, params, samples, n_samples, windows)) {
+            WHISPER_LOG_ERROR("%s: failed to compute VAD\n", __func__);
+            return -1;
+        }
+        return whisper_full_vad_windows(ctx, state, params, samples, windows, 0, windows.size());
+    }
+
     std::vector<float> vad_samples;
     if (params.vad) {
         WHISPER_LOG_INFO("%s: VAD is enabled, processing speech segments only\n", __func__);
-        if (!whisper_vad(ctx, ctx->state, params, samples, n_samples, vad_samples)) {
+        if (!whisper_vad(ctx, state, params, samples, n_samples, vad_samples)) {
             WHISPER_LOG_ERROR("%s: failed to compute VAD\n", __func__);
             return -1;
         }
         if (vad_samples.empty()) {
-            ctx->state->result_all.clear();
+            state->result_all.clear();
             return 0;
         }
         samples = vad_samples.data();
         n_samples = vad_samples.size();
     }
-    return whisper_full_with_state(ctx, ctx->state, params, samples, n_samples);
+    return whisper_full_with_state(ctx, state, params, samples, n_samples);
 }
 
-int whisper_full_parallel(
+int whisper_full(
+        struct whisper_context * ctx,
+    struct whisper_full_params   params,
+                   const float * samples,
+                           int   n_samples) {
+    return whisper_full_vad_with_state(ctx, ctx->state, params, samples, n_samples);
+}
+
+// accumulate the timings of a worker state into the main state
+static void whisper_state_add_timings(whisper_state & dst, const whisper_state & src) {
+    dst.t_mel_us += src.t_mel_us;
+
+    dst.t_sample_us += src.t_sample_us;
+    dst.t_encode_us += src.t_encode_us;
+    dst.t_decode_us += src.t_decode_us;
+    dst.t_batchd_us += src.t_batchd_us;
+    dst.t_prompt_us += src.t_prompt_us;
+
+    dst.n_sample += src.n_sample;
+    dst.n_encode += src.n_encode;
+    dst.n_decode += src.n_decode;
+    dst.n_batchd += src.n_batchd;
+    dst.n_prompt += src.n_prompt;
+
+    for (int k = 0; k < WHISPER_HOT_COUNT; ++k) {
+        dst.hot[k].t_us += src.hot[k].t_us;
+        dst.hot[k].n    += src.hot[k].n;
+    }
+}
+
+// transcribe the VAD schedule with n_processors states
+// the windows are independent, so they are split into contiguous groups of about the same duration
+// and there are no chunk boundaries inside the speech
+static int whisper_full_parallel_vad_schedule(
         struct whisper_context * ctx,
         struct whisper_full_params params,
         const float * samples,
         int n_samples,
         int n_processors) {
+    std::vector<whisper_vad_window> windows;
+    if (!whisper_vad_schedule(ctx->state, params, samples, n_samples, windows)) {
+        WHISPER_LOG_ERROR("%s: failed to compute VAD\n", __func__);
+        return -1;
+    }
 
+    n_processors = std::max(1, std::min(n_processors, (int) windows.size()));
     if (n_processors == 1) {
-        return whisper_full(ctx, params, samples, n_samples);
+        return whisper_full_vad_windows(ctx, ctx->state, params, samples, windows, 0, windows.size());
     }
 
-    std::vector<float> vad_samples;
-    if (params.vad) {
-        WHISPER_LOG_INFO("%s: VAD is enabled, processing speech segments only\n", __func__);
-        if (!whisper_vad(ctx, ctx->state, params, samples, n_samples, vad_samples)) {
-            WHISPER_LOG_ERROR("%s: failed to compute VAD\n", __func__);
-            return -1;
-        }
-        if (vad_samples.empty()) {
-            return 0;
-        }
-        samples = vad_samples.data();
-        n_samples = vad_samples.size();
+    int64_t n_total = 0;
+    for (const auto & w : windows) {
+        n_total += w.i1 - w.i0;
     }
-    int ret = 0;
-
-    // prepare separate states for each thread
-    std::vector<whisper_state*> states;
 
-    const int offset_samples = (WHISPER_SAMPLE_RATE*params.offset_ms)/1000;
-    const int n_samples_per_processor = (n_samples - offset_samples)/n_processors;
+    // group boundaries: group i covers the windows [w_split[i], w_split[i + 1])
+    std::vector<int> w_split(n_processors + 1, (int) windows.size());
+    w_split[0] = 0;
+    {
+        int64_t n_cur = 0;
+        int     g     = 1;
+        for (int w = 0; w < (int) windows.size() && g < n_processors; ++w) {
+            n_cur += windows[w].i1 - windows[w].i0;
+            if (n_cur*n_processors >= n_total*g || (int) windows.size() - (w + 1) == n_processors - g) {
+                w_split[g++] = w + 1;
+            }
+        }
+    }
 
-    // the calling thread will process the first chunk
-    // while the other threads will process the remaining chunks
+    std::vector<whisper_state *> states(n_processors - 1);
+    std::vector<int>             rets(n_processors - 1, 0);
+    std::vector<std::thread>     workers(n_processors - 1);
 
-    std::vector<std::thread> workers(n_processors - 1);
     for (int i = 0; i < n_processors - 1; ++i) {
-        // create a new state for each thread
-        states.push_back(whisper_init_state(ctx));
-
-        const int start_samples = offset_samples + (i + 1)*n_samples_per_processor;
-        const int n_samples_cur = (i == n_processors - 2) ? n_samples - start_samples : n_samples_per_processor;
+        states[i] = whisper_init_state(ctx);
 
         auto params_cur = params;
 
-        params_cur.offset_ms = 0;
         params_cur.print_progress = false;
         params_cur.print_realtime = false;
 
@@ -7823,14 +9635,111 @@ int whisper_full_parallel(
         params_cur.progress_callback = nullptr;
         params_cur.progress_callback_user_data = nullptr;
 
-        workers[i] = std::thread(whisper_full_with_state, ctx, states[i], std::move(params_cur), samples + start_samples, n_samples_cur);
+        workers[i] = std::thread([&, i, params_cur]() {
+            rets[i] = whisper_full_vad_windows(ctx, states[i], params_cur, samples, windows, w_split[i + 1], w_split[i + 2]);
+        });
     }
 
-    {
-        auto params_cur = params;
-
-        // We need to disable the print real-time for this one as well, otherwise it will show only for the first chunk.
-        params_cur.print_realtime = false;
+    int ret = whisper_full_vad_windows(ctx, ctx->state, params, samples, windows, w_split[0], w_split[1]);
+
+    for (int i = 0; i < n_processors - 1; ++i) {
+        workers[i].join();
+    }
+
+    // the segments already have their timestamps in the original timeline
+    for (int i = 0; i < n_processors - 1; ++i) {
+        if (ret == 0) {
+            ret = rets[i];
+        }
+
+        for (auto & result : states[i]->result_all) {
+            ctx->state->result_all.push_back(std::move(result));
+
+            if (params.new_segment_callback) {
+                params.new_segment_callback(ctx, ctx->state, 1, params.new_segment_callback_user_data);
+            }
+        }
+
+        whisper_state_add_timings(*ctx->state, *states[i]);
+
+        whisper_free_state(states[i]);
+    }
+
+    ctx->state->t_mel_us    /= n_processors;
+    ctx->state->t_sample_us /= n_processors;
+    ctx->state->t_encode_us /= n_processors;
+    ctx->state->t_decode_us /= n_processors;
+
+    return ret;
+}
+
+int whisper_full_parallel(
+        struct whisper_context * ctx,
+        struct whisper_full_params params,
+        const float * samples,
+        int n_samples,
+        int n_processors) {
+
+    if (n_processors == 1) {
+        return whisper_full(ctx, params, samples, n_samples);
+    }
+
+    if (params.vad && params.vad_schedule) {
+        return whisper_full_parallel_vad_schedule(ctx, params, samples, n_samples, n_processors);
+    }
+
+    std::vector<float> vad_samples;
+    if (params.vad) {
+        WHISPER_LOG_INFO("%s: VAD is enabled, processing speech segments only\n", __func__);
+        if (!whisper_vad(ctx, ctx->state, params, samples, n_samples, vad_samples)) {
+            WHISPER_LOG_ERROR("%s: failed to compute VAD\n", __func__);
+            return -1;
+        }
+        if (vad_samples.empty()) {
+            return 0;
+        }
+        samples = vad_samples.data();
+        n_samples = vad_samples.size();
+    }
+    int ret = 0;
+
+    // prepare separate states for each thread
+    std::vector<whisper_state*> states;
+
+    const int offset_samples = (WHISPER_SAMPLE_RATE*params.offset_ms)/1000;
+    const int n_samples_per_processor = (n_samples - offset_samples)/n_processors;
+
+    // the calling thread will process the first chunk
+    // while the other threads will process the remaining chunks
+
+    std::vector<std::thread> workers(n_processors - 1);
+    for (int i = 0; i < n_processors - 1; ++i) {
+        // create a new state for each thread
+        states.push_back(whisper_init_state(ctx));
+
+        const int start_samples = offset_samples + (i + 1)*n_samples_per_processor;
+        const int n_samples_cur = (i == n_processors - 2) ? n_samples - start_samples : n_samples_per_processor;
+
+        auto params_cur = params;
+
+        params_cur.offset_ms = 0;
+        params_cur.print_progress = false;
+        params_cur.print_realtime = false;
+
+        params_cur.new_segment_callback = nullptr;
+        params_cur.new_segment_callback_user_data = nullptr;
+
+        params_cur.progress_callback = nullptr;
+        params_cur.progress_callback_user_data = nullptr;
+
+        workers[i] = std::thread(whisper_full_with_state, ctx, states[i], std::move(params_cur), samples + start_samples, n_samples_cur);
+    }
+
+    {
+        auto params_cur = params;
+
+        // We need to disable the print real-time for this one as well, otherwise it will show only for the first chunk.
+        params_cur.print_realtime = false;
 
         // Run the first transformation using default state but only for the first chunk.
         ret = whisper_full_with_state(ctx, ctx->state, std::move(params_cur), samples, offset_samples + n_samples_per_processor);
@@ -7864,19 +9773,7 @@ int whisper_full_parallel(
             }
         }
 
-        ctx->state->t_mel_us += states[i]->t_mel_us;
-
-        ctx->state->t_sample_us += states[i]->t_sample_us;
-        ctx->state->t_encode_us += states[i]->t_encode_us;
-        ctx->state->t_decode_us += states[i]->t_decode_us;
-        ctx->state->t_batchd_us += states[i]->t_batchd_us;
-        ctx->state->t_prompt_us += states[i]->t_prompt_us;
-
-        ctx->state->n_sample += states[i]->n_sample;
-        ctx->state->n_encode += states[i]->n_encode;
-        ctx->state->n_decode += states[i]->n_decode;
-        ctx->state->n_batchd += states[i]->n_batchd;
-        ctx->state->n_prompt += states[i]->n_prompt;
+        whisper_state_add_timings(*ctx->state, *states[i]);
 
         whisper_free_state(states[i]);
     }
@@ -7898,6 +9795,168 @@ int whisper_full_parallel(
     return ret;
 }
 
+struct whisper_batch_params whisper_batch_default_params(void) {
+    whisper_batch_params result = {
+        /*.n_threads                 =*/ std::max(1, (int32_t) std::thread::hardware_concurrency()),
+        /*.n_states                  =*/ WHISPER_BATCH_N_STATES,
+        /*.n_samples_per_thread      =*/ WHISPER_CHUNK_SIZE*WHISPER_SAMPLE_RATE,
+        /*.result_callback           =*/ nullptr,
+        /*.result_callback_user_data =*/ nullptr,
+    };
+    return result;
+}
+
+// queue of input ids owned by one worker of whisper_full_batch
+// the owner takes the longest input from the front, thieves take the shortest from the back
+struct whisper_batch_queue {
+    std::mutex       mutex;
+    std::deque<int>  ids;
+};
+
+int whisper_full_batch(
+        struct whisper_context * ctx,
+        struct whisper_full_params params,
+        const struct whisper_batch_input * inputs,
+        int n_inputs,
+        struct whisper_batch_params bparams) {
+    if (n_inputs <= 0) {
+        return 0;
+    }
+
+    const int n_threads  = bparams.n_threads > 0 ? bparams.n_threads : std::max(1, (int) std::thread::hardware_concurrency());
+    const int n_workers  = std::max(1, std::min(n_inputs, bparams.n_states > 0 ? bparams.n_states : WHISPER_BATCH_N_STATES));
+    const int n_per_thr  = bparams.n_samples_per_thread > 0 ? bparams.n_samples_per_thread : WHISPER_CHUNK_SIZE*WHISPER_SAMPLE_RATE;
+
+    // the default state is the first state of the pool
+    std::vector<whisper_state *> states(n_workers, nullptr);
+    for (int i = 0; i < n_workers; ++i) {
+        states[i] = (i == 0 && ctx->state) ? ctx->state : whisper_init_state(ctx);
+        if (states[i] == nullptr) {
+            WHISPER_LOG_ERROR("%s: failed to create state %d of %d\n", __func__, i, n_workers);
+            for (int j = 0; j < i; ++j) {
+                if (states[j] != ctx->state) {
+                    whisper_free_state(states[j]);
+                }
+            }
+            return -1;
+        }
+    }
+
+    // deal the inputs longest first, so that every queue holds a similar amount of audio
+    std::vector<int> order(n_inputs);
+    for (int i = 0; i < n_inputs; ++i) {
+        order[i] = i;
+    }
+    std::stable_sort(order.begin(), order.end(), [&](int a, int b) {
+        return inputs[a].n_samples > inputs[b].n_samples;
+    });
+
+    std::vector<whisper_batch_queue> queues(n_workers);
+    for (int i = 0; i < n_inputs; ++i) {
+        queues[i % n_workers].ids.push_back(order[i]);
+    }
+
+    // thread budget shared by the workers
+    std::mutex              thr_mutex;
+    std::condition_variable thr_cv;
+    int                     thr_free = n_threads;
+
+    std::atomic<int> n_failed(0);
+
+    auto pop = [&](int iw) -> int {
+        {
+            auto & q = queues[iw];
+            std::lock_guard<std::mutex> lock(q.mutex);
+            if (!q.ids.empty()) {
+                const int id = q.ids.front();
+                q.ids.pop_front();
+                return id;
+            }
+        }
+        for (int k = 1; k < n_workers; ++k) {
+            auto & q = queues[(iw + k) % n_workers];
+            std::lock_guard<std::mutex> lock(q.mutex);
+            if (!q.ids.empty()) {
+                const int id = q.ids.back();
+                q.ids.pop_back();
+                return id;
+            }
+        }
+        return -1;
+    };
+
+    auto worker = [&](int iw) {
+        whisper_state * state = states[iw];
+
+        while (true) {
+            const int id = pop(iw);
+            if (id < 0) {
+                break;
+            }
+
+            const auto & input = inputs[id];
+
+            // wait for at least one thread and take as many as the input asks for
+            const int n_want = std::min(n_threads, std::max(1, (input.n_samples + n_per_thr - 1)/n_per_thr));
+
+            int n_thr = 0;
+            {
+                std::unique_lock<std::mutex> lock(thr_mutex);
+                thr_cv.wait(lock, [&]() { return thr_free > 0; });
+                n_thr = std::min(n_want, thr_free);
+                thr_free -= n_thr;
+            }
+
+            auto params_cur = params;
+
+            // the tuned encoder / decoder thread counts take precedence over n_threads, keep them within the grant
+            params_cur.n_threads        = n_thr;
+            params_cur.n_threads_encode = std::min(params.n_threads_encode, n_thr);
+            params_cur.n_threads_decode = std::min(params.n_threads_decode, n_thr);
+            params_cur.print_progress   = false;
+            params_cur.print_realtime = false;
+
+            const int ret = whisper_full_vad_with_state(ctx, state, params_cur, input.samples, input.n_samples);
+            if (ret != 0) {
+                WHISPER_LOG_ERROR("%s: failed to process input %d (%d)\n", __func__, id, ret);
+                n_failed++;
+            }
+
+            if (bparams.result_callback) {
+                bparams.result_callback(ctx, state, id, ret, input.user_data, bparams.result_callback_user_data);
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(thr_mutex);
+                thr_free += n_thr;
+            }
+            thr_cv.notify_all();
+        }
+    };
+
+    std::vector<std::thread> workers(n_workers - 1);
+    for (int i = 1; i < n_workers; ++i) {
+        workers[i - 1] = std::thread(worker, i);
+    }
+
+    worker(0);
+
+    for (auto & w : workers) {
+        w.join();
+    }
+
+    for (int i = 0; i < n_workers; ++i) {
+        if (states[i] != ctx->state) {
+            if (ctx->state) {
+                whisper_state_add_timings(*ctx->state, *states[i]);
+            }
+            whisper_free_state(states[i]);
+        }
+    }
+
+    return n_failed.load();
+}
+
 int whisper_full_n_segments_from_state(struct whisper_state * state) {
     return state->result_all.size();
 }
@@ -8258,6 +10317,7 @@ WHISPER_API const char * whisper_bench_ggml_mul_mat_str(int n_threads) {
         int n_q5_1 = 0;
         int n_q8_0 = 0;
         int n_fp16 = 0;
+        int n_bf16 = 0;
         int n_fp32 = 0;
 
         // GFLOPS/s
@@ -8267,21 +10327,23 @@ WHISPER_API const char * whisper_bench_ggml_mul_mat_str(int n_threads) {
         double s_q5_1 = 0.0;
         double s_q8_0 = 0.0;
         double s_fp16 = 0.0;
+        double s_bf16 = 0.0;
         double s_fp32 = 0.0;
 
         const size_t N = sizes[j];
 
-        for (int k = 0; k < 7; ++k) {
+        for (int k = 0; k < 8; ++k) {
             const ggml_type wtype =
                 k == 0 ? GGML_TYPE_Q4_0 :
                 k == 1 ? GGML_TYPE_Q4_1 :
                 k == 2 ? GGML_TYPE_Q5_0 :
                 k == 3 ? GGML_TYPE_Q5_1 :
                 k == 4 ? GGML_TYPE_Q8_0 :
-                k == 5 ? GGML_TYPE_F16  : GGML_TYPE_F32;
+                k == 5 ? GGML_TYPE_F16  :
+                k == 6 ? GGML_TYPE_BF16 : GGML_TYPE_F32;
 
-            double & s = k == 0 ? s_q4_0 : k == 1 ? s_q4_1 : k == 2 ? s_q5_0 : k == 3 ? s_q5_1 : k == 4 ? s_q8_0 : k == 5 ? s_fp16 : /*k == 6*/ s_fp32;
-            int    & n = k == 0 ? n_q4_0 : k == 1 ? n_q4_1 : k == 2 ? n_q5_0 : k == 3 ? n_q5_1 : k == 4 ? n_q8_0 : k == 5 ? n_fp16 : /*k == 6*/ n_fp32;
+            double & s = k == 0 ? s_q4_0 : k == 1 ? s_q4_1 : k == 2 ? s_q5_0 : k == 3 ? s_q5_1 : k == 4 ? s_q8_0 : k == 5 ? s_fp16 : k == 6 ? s_bf16 : /*k == 7*/ s_fp32;
+            int    & n = k == 0 ? n_q4_0 : k == 1 ? n_q4_1 : k == 2 ? n_q5_0 : k == 3 ? n_q5_1 : k == 4 ? n_q8_0 : k == 5 ? n_fp16 : k == 6 ? n_bf16 : /*k == 7*/ n_fp32;
 
             struct ggml_init_params gparams = {
                 /*.mem_size   =*/ buf.size(),
@@ -8335,140 +10397,1091 @@ WHISPER_API const char * whisper_bench_ggml_mul_mat_str(int n_threads) {
                 N, N, s_q5_0, n_q5_0, s_q5_1, n_q5_1, s_q8_0, n_q8_0);
         s += strbuf;
 
-        // F16 | F32
-        snprintf(strbuf, sizeof(strbuf), "%4zu x %4zu: F16  %7.1f GFLOPS (%3d runs) | F32  %7.1f GFLOPS (%3d runs)\n",
-                N, N, s_fp16, n_fp16, s_fp32, n_fp32);
+        // F16 | BF16 | F32
+        snprintf(strbuf, sizeof(strbuf), "%4zu x %4zu: F16  %7.1f GFLOPS (%3d runs) | BF16 %7.1f GFLOPS (%3d runs) | F32  %7.1f GFLOPS (%3d runs)\n",
+                N, N, s_fp16, n_fp16, s_bf16, n_bf16, s_fp32, n_fp32);
         s += strbuf;
     }
 
     return s.c_str();
 }
 
-// =================================================================================================
-
-// =================================================================================================
-
-//
-// Experimental stuff below
 //
-// Not sure if these should be part of the library at all, because the quality of the results is not
-// guaranteed. Might get removed at some point unless a robust algorithm implementation is found
+// regression suite
 //
 
-// =================================================================================================
-
-//
-// token-level timestamps
-//
+struct whisper_bench_entry {
+    std::string        name;
+    std::vector<float> samples;
+};
 
-static int64_t sample_to_timestamp(int i_sample) {
-    return (100ll*i_sample)/WHISPER_SAMPLE_RATE;
-}
+struct whisper_bench_config {
+    std::string                name;
+    struct whisper_full_params params;
+};
 
-// a cost-function / heuristic that is high for text that takes longer to pronounce
-// obviously, can be improved
-static float voice_length(const std::string & text) {
-    float res = 0.0f;
+// 1 s tone bursts of varying pitch separated by 1.5 s of silence
+static std::vector<float> whisper_bench_tone_bursts(int n_sec) {
+    const int sr = WHISPER_SAMPLE_RATE;
 
-    for (char c : text) {
-        if (c == ' ') {
-            res += 0.01f;
-        } else if (c == ',') {
-            res += 2.00f;
-        } else if (c == '.') {
-            res += 3.00f;
-        } else if (c == '!') {
-            res += 3.00f;
-        } else if (c == '?') {
-            res += 3.00f;
-        } else if (c >= '0' && c <= '9') {
-            res += 3.00f;
-        } else {
-            res += 1.00f;
+    std::vector<float> pcm(n_sec*sr, 0.0f);
+    for (int i = 0; i < (int) pcm.size(); ++i) {
+        const int k  = i/(5*sr/2);
+        const int ms = ((1000ll*i)/sr) % 2500;
+        if (ms < 1000) {
+            pcm[i] = 0.3f*sin((2.0*M_PI*(200.0 + 50.0*(k % 8))*i)/sr);
         }
     }
 
-    return res;
+    return pcm;
 }
 
-// average the fabs of the signal
-static std::vector<float> get_signal_energy(const float * signal, int n_samples, int n_samples_per_half_window) {
-    const int hw = n_samples_per_half_window;
+// the synthetic part of the corpus is generated analytically (no RNG) so it is identical on all platforms
+static std::vector<whisper_bench_entry> whisper_bench_corpus(const whisper_bench_params & bparams) {
+    const int sr = WHISPER_SAMPLE_RATE;
 
-    std::vector<float> result(n_samples);
+    std::vector<whisper_bench_entry> corpus;
 
-    for (int i = 0; i < n_samples; i++) {
-        float sum = 0;
-        for (int j = -hw; j <= hw; j++) {
-            if (i + j >= 0 && i + j < n_samples) {
-                sum += fabs(signal[i + j]);
-            }
+    corpus.push_back({ "silence_5s", std::vector<float>(5*sr, 0.0f) });
+
+    {
+        std::vector<float> pcm(5*sr);
+        for (int i = 0; i < (int) pcm.size(); ++i) {
+            pcm[i] = 0.3f*sin((2.0*M_PI*440.0*i)/sr);
         }
-        result[i] = sum/(2*hw + 1);
+        corpus.push_back({ "tone_440hz_5s", std::move(pcm) });
     }
 
-    return result;
-}
+    // linear sweep 100 Hz -> 4 kHz
+    {
+        const double f0 = 100.0;
+        const double f1 = 4000.0;
+        const double T  = 8.0;
 
-static int timestamp_to_sample(int64_t t, int64_t segment_t0, int n_samples) {
-    // Convert absolute timestamp to segment-relative timestamp
-    int64_t relative_t = t - segment_t0;
-    int sample = (int)((relative_t * WHISPER_SAMPLE_RATE) / 100);
-    return std::max(0, std::min(n_samples - 1, sample));
-}
+        std::vector<float> pcm(T*sr);
+        for (int i = 0; i < (int) pcm.size(); ++i) {
+            const double t = (double) i/sr;
+            pcm[i] = 0.3f*sin(2.0*M_PI*(f0*t + 0.5*(f1 - f0)*t*t/T));
+        }
+        corpus.push_back({ "sweep_8s", std::move(pcm) });
+    }
 
-static int64_t sample_to_timestamp(int i_sample, int64_t segment_t0) {
-    int64_t relative_timestamp = (100ll * i_sample) / WHISPER_SAMPLE_RATE;
-    return relative_timestamp + segment_t0;
+    // spans more than one 30 s window
+    corpus.push_back({ "bursts_40s", whisper_bench_tone_bursts(40) });
+
+    for (int i = 0; i < bparams.n_clips; ++i) {
+        const auto & clip = bparams.clips[i];
+        corpus.push_back({ clip.name ? clip.name : format("clip_%d", i), std::vector<float>(clip.samples, clip.samples + clip.n_samples) });
+    }
+
+    return corpus;
 }
 
-static void whisper_exp_compute_token_level_timestamps(
-        struct whisper_context & ctx,
-          struct whisper_state & state,
-                           int   i_segment,
-                         float   thold_pt,
-                         float   thold_ptsum) {
-    auto & segment = state.result_all[i_segment];
-    auto & tokens  = segment.tokens;
+static std::vector<whisper_bench_config> whisper_bench_configs(struct whisper_context * ctx, const whisper_bench_params & bparams) {
+    auto make = [&](enum whisper_sampling_strategy strategy) {
+        whisper_full_params params = whisper_full_default_params(strategy);
 
-    const int n_samples = state.energy.size();
+        params.n_threads       = bparams.n_threads;
+        params.print_progress  = false;
+        params.print_realtime  = false;
+        params.no_context      = true;
+        params.temperature_inc = 0.0f; // deterministic - no sampling fallback
 
-    if (n_samples == 0) {
-        WHISPER_LOG_ERROR("%s: no signal data available\n", __func__);
-        return;
-    }
+        return params;
+    };
 
-    const int64_t t0 = segment.t0;
-    const int64_t t1 = segment.t1;
+    std::vector<whisper_bench_config> configs;
 
-    const int n = tokens.size();
+    configs.push_back({ "greedy", make(WHISPER_SAMPLING_GREEDY) });
 
-    if (n == 0) {
-        return;
+    {
+        auto params = make(WHISPER_SAMPLING_BEAM_SEARCH);
+        params.beam_search.beam_size = 5;
+        configs.push_back({ "beam5", params });
     }
 
-    if (n == 1) {
-        tokens[0].t0 = t0;
-        tokens[0].t1 = t1;
+    {
+        auto params = make(WHISPER_SAMPLING_GREEDY);
+        params.token_timestamps = true;
+        configs.push_back({ "token_ts", params });
+    }
 
-        return;
+    if (bparams.vad_model_path) {
+        auto params = make(WHISPER_SAMPLING_GREEDY);
+        params.vad            = true;
+        params.vad_model_path = bparams.vad_model_path;
+        configs.push_back({ "vad", params });
     }
 
-    auto & t_beg    = state.t_beg;
-    auto & t_last   = state.t_last;
-    auto & tid_last = state.tid_last;
+    if (bparams.vad_model_path) {
+        auto params = make(WHISPER_SAMPLING_GREEDY);
+        params.vad            = true;
+        params.vad_model_path = bparams.vad_model_path;
+        params.vad_schedule   = true;
+        configs.push_back({ "vad_sched", params });
+    }
 
-    for (int j = 0; j < n; ++j) {
-        auto & token = tokens[j];
+    for (int div : { 2, 4 }) {
+        auto params = make(WHISPER_SAMPLING_GREEDY);
+        params.audio_ctx = whisper_n_audio_ctx(ctx)/div;
+        configs.push_back({ format("audio_ctx_%d", params.audio_ctx), params });
+    }
 
-        if (j == 0) {
-            if (token.id == whisper_token_beg(&ctx)) {
-                tokens[j    ].t0 = t0;
-                tokens[j    ].t1 = t0;
-                tokens[j + 1].t0 = t0;
+    return configs;
+}
 
-                t_beg    = t0;
-                t_last   = t0;
+// one line per segment (and per token when token timestamps are enabled):
+// config \t clip \t kind \t t0 \t t1 \t text
+static void whisper_bench_dump(struct whisper_context * ctx, const std::string & key, bool tokens, std::vector<std::string> & lines) {
+    auto sanitize = [](std::string text) {
+        for (auto & c : text) {
+            if (c == '\t' || c == '\n' || c == '\r') {
+                c = ' ';
+            }
+        }
+        return text;
+    };
+
+    const int n_segments = whisper_full_n_segments(ctx);
+    for (int i = 0; i < n_segments; ++i) {
+        lines.push_back(key + "\tseg\t" +
+                std::to_string(whisper_full_get_segment_t0(ctx, i)) + "\t" +
+                std::to_string(whisper_full_get_segment_t1(ctx, i)) + "\t" +
+                sanitize(whisper_full_get_segment_text(ctx, i)));
+
+        if (!tokens) {
+            continue;
+        }
+
+        for (int j = 0; j < whisper_full_n_tokens(ctx, i); ++j) {
+            const auto data = whisper_full_get_token_data(ctx, i, j);
+            lines.push_back(key + "\ttok\t" + std::to_string(data.t0) + "\t" + std::to_string(data.t1) + "\t" + std::to_string(data.id));
+        }
+    }
+}
+
+// compare two dump lines - exact text, timestamps within the tolerance (in ms, timestamps are in 10 ms units)
+static bool whisper_bench_line_match(const std::string & a, const std::string & b, int ts_tolerance_ms) {
+    auto split = [](const std::string & line) {
+        std::vector<std::string> res;
+        size_t pos = 0;
+        for (int i = 0; i < 5; ++i) {
+            const size_t end = line.find('\t', pos);
+            if (end == std::string::npos) {
+                break;
+            }
+            res.push_back(line.substr(pos, end - pos));
+            pos = end + 1;
+        }
+        res.push_back(line.substr(pos));
+        return res;
+    };
+
+    const auto fa = split(a);
+    const auto fb = split(b);
+
+    if (fa.size() != 6 || fb.size() != 6) {
+        return a == b;
+    }
+
+    if (fa[0] != fb[0] || fa[1] != fb[1] || fa[2] != fb[2] || fa[5] != fb[5]) {
+        return false;
+    }
+
+    for (int i = 3; i <= 4; ++i) {
+        if (10*std::abs(std::stoll(fa[i]) - std::stoll(fb[i])) > ts_tolerance_ms) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static int whisper_bench_full_impl(struct whisper_context * ctx, const whisper_bench_params & bparams, std::string & s) {
+    char strbuf[256];
+
+    if (ctx->state == nullptr) {
+        WHISPER_LOG_ERROR("%s: the regression suite requires the default state\n", __func__);
+        return -1;
+    }
+
+    ggml_time_init();
+
+    // golden outputs, grouped by "config \t clip"
+    std::map<std::string, std::vector<std::string>> golden;
+    bool have_golden = false;
+
+    if (bparams.path_golden) {
+        std::ifstream fin(bparams.path_golden);
+        if (fin) {
+            std::string line;
+            while (std::getline(fin, line)) {
+                if (line.empty() || line[0] == '#') {
+                    continue;
+                }
+                const size_t p0 = line.find('\t');
+                const size_t p1 = p0 == std::string::npos ? p0 : line.find('\t', p0 + 1);
+                if (p1 == std::string::npos) {
+                    continue;
+                }
+                golden[line.substr(0, p1)].push_back(line);
+            }
+            have_golden = true;
+        }
+    }
+
+    const auto corpus  = whisper_bench_corpus(bparams);
+    const auto configs = whisper_bench_configs(ctx, bparams);
+
+    std::vector<std::string> lines_all;
+
+    int n_runs     = 0;
+    int n_mismatch = 0;
+
+    snprintf(strbuf, sizeof(strbuf), "%-16s %-16s %9s %9s %7s %9s  %s\n", "config", "clip", "audio", "time", "RTF", "tokens/s", "check");
+    s += strbuf;
+
+    for (const auto & config : configs) {
+        double t_audio_sum = 0.0;
+        double t_proc_sum  = 0.0;
+        int    n_tok_sum   = 0;
+
+        for (const auto & entry : corpus) {
+            const std::string key = config.name + "\t" + entry.name;
+
+            const int64_t t_start_us = ggml_time_us();
+
+            if (whisper_full(ctx, config.params, entry.samples.data(), entry.samples.size()) != 0) {
+                WHISPER_LOG_ERROR("%s: failed to process clip '%s' with config '%s'\n", __func__, entry.name.c_str(), config.name.c_str());
+                return -2;
+            }
+
+            const double t_proc  = (ggml_time_us() - t_start_us)*1e-6;
+            const double t_audio = (double) entry.samples.size()/WHISPER_SAMPLE_RATE;
+
+            int n_tok = 0;
+            for (int i = 0; i < whisper_full_n_segments(ctx); ++i) {
+                n_tok += whisper_full_n_tokens(ctx, i);
+            }
+
+            std::vector<std::string> lines;
+            whisper_bench_dump(ctx, key, config.params.token_timestamps, lines);
+
+            const char * check = "-";
+            if (have_golden) {
+                const auto it = golden.find(key);
+                if (it == golden.end()) {
+                    check = "NO GOLDEN";
+                } else {
+                    bool match = it->second.size() == lines.size();
+                    for (size_t i = 0; match && i < lines.size(); ++i) {
+                        match = whisper_bench_line_match(lines[i], it->second[i], bparams.ts_tolerance_ms);
+                    }
+                    check = match ? "OK" : "MISMATCH";
+                    n_mismatch += match ? 0 : 1;
+                }
+            }
+
+            snprintf(strbuf, sizeof(strbuf), "%-16s %-16s %7.2f s %7.2f s %7.3f %9.1f  %s\n",
+                    config.name.c_str(), entry.name.c_str(), t_audio, t_proc, t_proc/t_audio, n_tok/std::max(t_proc, 1e-6), check);
+            s += strbuf;
+
+            lines_all.insert(lines_all.end(), lines.begin(), lines.end());
+
+            t_audio_sum += t_audio;
+            t_proc_sum  += t_proc;
+            n_tok_sum   += n_tok;
+            n_runs++;
+        }
+
+        snprintf(strbuf, sizeof(strbuf), "%-16s %-16s %7.2f s %7.2f s %7.3f %9.1f\n",
+                config.name.c_str(), "(total)", t_audio_sum, t_proc_sum, t_proc_sum/t_audio_sum, n_tok_sum/std::max(t_proc_sum, 1e-6));
+        s += strbuf;
+    }
+
+    if (bparams.path_golden && !have_golden) {
+        std::ofstream fout(bparams.path_golden);
+        if (!fout) {
+            WHISPER_LOG_ERROR("%s: failed to write golden outputs to '%s'\n", __func__, bparams.path_golden);
+            return -3;
+        }
+        fout << "# whisper regression suite golden outputs: config, clip, kind, t0, t1, text\n";
+        for (const auto & line : lines_all) {
+            fout << line << "\n";
+        }
+
+        snprintf(strbuf, sizeof(strbuf), "golden outputs written to '%s'\n", bparams.path_golden);
+        s += strbuf;
+    }
+
+    snprintf(strbuf, sizeof(strbuf), "runs: %d, mismatches: %d\n", n_runs, n_mismatch);
+    s += strbuf;
+
+    return n_mismatch;
+}
+
+struct whisper_bench_params whisper_bench_default_params(void) {
+    whisper_bench_params result = {
+        /*.n_threads       =*/ std::min(4, (int32_t) std::thread::hardware_concurrency()),
+        /*.path_golden     =*/ nullptr,
+        /*.vad_model_path  =*/ nullptr,
+        /*.ts_tolerance_ms =*/ 100,
+        /*.clips           =*/ nullptr,
+        /*.n_clips         =*/ 0,
+    };
+    return result;
+}
+
+WHISPER_API int whisper_bench_full(struct whisper_context * ctx, struct whisper_bench_params params) {
+    std::string s;
+    const int ret = whisper_bench_full_impl(ctx, params, s);
+    fputs(s.c_str(), stderr);
+    return ret;
+}
+
+WHISPER_API const char * whisper_bench_full_str(struct whisper_context * ctx, struct whisper_bench_params params) {
+    static std::string s;
+    s = "";
+    whisper_bench_full_impl(ctx, params, s);
+    return s.c_str();
+}
+
+//
+// streaming latency benchmark
+//
+
+struct whisper_bench_word {
+    std::string text;
+    double      t_end; // end of the word in the stream [s]
+};
+
+static double whisper_bench_cpu_time_s() {
+#ifndef _WIN32
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+        return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + 1e-6*(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec);
+    }
+#endif
+    return 0.0;
+}
+
+// split the result of the last window into words, using the token-level timestamps for the word ends
+static void whisper_bench_words(struct whisper_context * ctx, struct whisper_state * state, double t_offset, std::vector<whisper_bench_word> & words) {
+    words.clear();
+
+    for (const auto & segment : state->result_all) {
+        for (const auto & token : segment.tokens) {
+            if (token.id >= whisper_token_eot(ctx)) {
+                continue;
+            }
+
+            const std::string & text = ctx->vocab.id_to_token.at(token.id);
+            if (text.empty()) {
+                continue;
+            }
+
+            if (words.empty() || text[0] == ' ') {
+                words.push_back({ "", t_offset });
+            }
+
+            words.back().text += text;
+            words.back().t_end = t_offset + 0.01*(token.t1 >= 0 ? token.t1 : segment.t1);
+        }
+    }
+}
+
+static float whisper_bench_percentile(std::vector<float> values, float p) {
+    if (values.empty()) {
+        return 0.0f;
+    }
+
+    std::sort(values.begin(), values.end());
+
+    return values[std::min<size_t>(values.size() - 1, p*values.size())];
+}
+
+static int whisper_bench_stream_impl(
+        struct whisper_context * ctx,
+        const whisper_bench_stream_params & bparams,
+        whisper_bench_stream_result & res,
+        std::string & s) {
+    char strbuf[256];
+
+    const int sr = WHISPER_SAMPLE_RATE;
+
+    if (bparams.step_ms <= 0 || bparams.length_ms < bparams.step_ms || bparams.speed <= 0.0f) {
+        WHISPER_LOG_ERROR("%s: invalid parameters (step_ms = %d, length_ms = %d, speed = %f)\n", __func__, bparams.step_ms, bparams.length_ms, bparams.speed);
+        return -1;
+    }
+
+    std::vector<float> pcm_synth;
+    if (bparams.samples == nullptr) {
+        pcm_synth = whisper_bench_tone_bursts(30);
+    }
+
+    const float * samples   = bparams.samples ? bparams.samples   : pcm_synth.data();
+    const int     n_samples = bparams.samples ? bparams.n_samples : (int) pcm_synth.size();
+
+    const int n_step = (1e-3*bparams.step_ms  )*sr;
+    const int n_len  = (1e-3*bparams.length_ms)*sr;
+    const int n_keep = (1e-3*bparams.keep_ms  )*sr;
+    const int n_buf  = (1e-3*std::max(bparams.buffer_ms, bparams.step_ms))*sr;
+
+    // number of steps after which the window is committed and restarted
+    const int n_new_line = std::max(1, bparams.length_ms/bparams.step_ms - 1);
+
+    struct whisper_state * state = whisper_init_state(ctx);
+    if (state == nullptr) {
+        WHISPER_LOG_ERROR("%s: failed to create state\n", __func__);
+        return -2;
+    }
+
+    whisper_full_params wparams = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
+
+    wparams.n_threads        = bparams.n_threads;
+    wparams.print_progress   = false;
+    wparams.print_realtime   = false;
+    wparams.single_segment   = true;
+    wparams.no_context       = true;
+    wparams.token_timestamps = true;
+    wparams.audio_ctx        = bparams.audio_ctx;
+    wparams.language         = bparams.language;
+
+    std::vector<float> pcm_old; // audio carried over from the previous step
+    std::vector<float> pcm_cur;
+
+    int64_t pos_old = 0; // stream position of pcm_old[0]
+    int64_t pos     = 0; // next sample to consume
+    int64_t dropped = 0;
+
+    std::vector<whisper_bench_word> words;
+    std::vector<whisper_bench_word> words_prev;
+
+    std::vector<float> emit_ms;
+    std::vector<float> commit_ms;
+
+    int n_iter = 0;
+
+    const double  cpu_start   = whisper_bench_cpu_time_s();
+    const int64_t t_start_us  = ggml_time_us();
+
+    // audio that has been "captured" by the time t_us
+    auto available = [&](int64_t t_us) {
+        return std::min<int64_t>(n_samples, (int64_t) (1e-6*(t_us - t_start_us)*bparams.speed*sr));
+    };
+
+    // wall-clock delay between the end of a word in the audio and now
+    auto delay_ms = [&](const whisper_bench_word & word) {
+        return (float) (1e-3*(ggml_time_us() - t_start_us) - 1e3*word.t_end/bparams.speed);
+    };
+
+    while (pos < n_samples) {
+        // wait for the next chunk
+        int64_t avail = available(ggml_time_us());
+        while (avail < std::min<int64_t>(pos + n_step, n_samples)) {
+            const double wait_s = (std::min<int64_t>(pos + n_step, n_samples) - avail)/(bparams.speed*sr);
+            std::this_thread::sleep_for(std::chrono::microseconds(std::max<int64_t>(100, (int64_t) (1e6*wait_s))));
+            avail = available(ggml_time_us());
+        }
+
+        // the capture buffer overflowed while we were busy - the oldest audio is lost
+        if (avail - pos > n_buf) {
+            dropped += avail - pos - n_buf;
+            pos      = avail - n_buf;
+            pcm_old.clear();
+        }
+
+        const int n_new  = avail - pos;
+        const int n_take = std::min<int>(pcm_old.size(), std::max(0, n_keep + n_len - n_new));
+
+        pcm_cur.resize(n_take + n_new);
+        std::copy(pcm_old.end() - n_take, pcm_old.end(), pcm_cur.begin());
+        std::copy(samples + pos, samples + avail, pcm_cur.begin() + n_take);
+
+        const int64_t pos_cur = pcm_old.empty() ? pos : pos_old + (int64_t) pcm_old.size() - n_take;
+
+        pos = avail;
+
+        if (whisper_full_with_state(ctx, state, wparams, pcm_cur.data(), pcm_cur.size()) != 0) {
+            WHISPER_LOG_ERROR("%s: failed to process audio\n", __func__);
+            whisper_free_state(state);
+            return -3;
+        }
+
+        whisper_bench_words(ctx, state, (double) pos_cur/sr, words);
+
+        // words that differ from the previous partial result of the same window are revisions,
+        // the words after the common prefix are (re-)emitted
+        size_t n_common = 0;
+        while (n_common < words.size() && n_common < words_prev.size() && words[n_common].text == words_prev[n_common].text) {
+            n_common++;
+        }
+
+        res.n_revised += words_prev.size() - n_common;
+
+        for (size_t i = n_common; i < words.size(); ++i) {
+            if (i >= words_prev.size()) {
+                emit_ms.push_back(delay_ms(words[i]));
+            }
+            res.n_emitted++;
+        }
+
+        words_prev = words;
+
+        n_iter++;
+
+        if (n_iter % n_new_line == 0) {
+            for (const auto & word : words) {
+                commit_ms.push_back(delay_ms(word));
+            }
+            res.n_committed += words.size();
+
+            words_prev.clear();
+
+            // keep part of the audio for the next window to mitigate word boundary issues
+            const int n_keep_cur = std::min<int>(n_keep, pcm_cur.size());
+            pcm_old.assign(pcm_cur.end() - n_keep_cur, pcm_cur.end());
+            pos_old = pos - n_keep_cur;
+        } else {
+            pcm_old = pcm_cur;
+            pos_old = pos_cur;
+        }
+    }
+
+    const double t_wall_s = 1e-6*(ggml_time_us() - t_start_us);
+
+    whisper_free_state(state);
+
+    res.emit_p50_ms   = whisper_bench_percentile(emit_ms,   0.50f);
+    res.emit_p90_ms   = whisper_bench_percentile(emit_ms,   0.90f);
+    res.emit_max_ms   = whisper_bench_percentile(emit_ms,   1.00f);
+    res.commit_p50_ms = whisper_bench_percentile(commit_ms, 0.50f);
+    res.commit_p90_ms = whisper_bench_percentile(commit_ms, 0.90f);
+    res.commit_max_ms = whisper_bench_percentile(commit_ms, 1.00f);
+    res.revision_rate = res.n_emitted > 0 ? (float) res.n_revised/res.n_emitted : 0.0f;
+    res.cpu_util      = (whisper_bench_cpu_time_s() - cpu_start)/t_wall_s;
+    res.dropped_ms    = (1e3*dropped)/sr;
+
+    snprintf(strbuf, sizeof(strbuf), "stream: %.2f s audio at %.2fx, step = %d ms, length = %d ms, keep = %d ms, threads = %d, audio_ctx = %d\n",
+            (float) n_samples/sr, bparams.speed, bparams.step_ms, bparams.length_ms, bparams.keep_ms, bparams.n_threads, bparams.audio_ctx);
+    s += strbuf;
+    snprintf(strbuf, sizeof(strbuf), "emit delay:   p50 = %8.1f ms, p90 = %8.1f ms, max = %8.1f ms (%d words)\n",
+            res.emit_p50_ms, res.emit_p90_ms, res.emit_max_ms, (int) emit_ms.size());
+    s += strbuf;
+    snprintf(strbuf, sizeof(strbuf), "commit delay: p50 = %8.1f ms, p90 = %8.1f ms, max = %8.1f ms (%d words)\n",
+            res.commit_p50_ms, res.commit_p90_ms, res.commit_max_ms, res.n_committed);
+    s += strbuf;
+    snprintf(strbuf, sizeof(strbuf), "revisions:    %d of %d emitted words (%.1f %%)\n",
+            res.n_revised, res.n_emitted, 100.0f*res.revision_rate);
+    s += strbuf;
+    snprintf(strbuf, sizeof(strbuf), "cpu:          %.2f cores busy (%d steps, %.2f s wall)\n", res.cpu_util, n_iter, t_wall_s);
+    s += strbuf;
+    snprintf(strbuf, sizeof(strbuf), "dropped:      %.1f ms of audio\n", res.dropped_ms);
+    s += strbuf;
+
+    return 0;
+}
+
+struct whisper_bench_stream_params whisper_bench_stream_default_params(void) {
+    whisper_bench_stream_params result = {
+        /*.n_threads =*/ std::min(4, (int32_t) std::thread::hardware_concurrency()),
+        /*.step_ms   =*/ 3000,
+        /*.length_ms =*/ 10000,
+        /*.keep_ms   =*/ 200,
+        /*.buffer_ms =*/ 20000,
+        /*.audio_ctx =*/ 0,
+        /*.speed     =*/ 1.0f,
+        /*.language  =*/ "en",
+        /*.samples   =*/ nullptr,
+        /*.n_samples =*/ 0,
+    };
+    return result;
+}
+
+WHISPER_API int whisper_bench_stream(struct whisper_context * ctx, struct whisper_bench_stream_params params, struct whisper_bench_stream_result * result) {
+    std::string s;
+    whisper_bench_stream_result res = {};
+    const int ret = whisper_bench_stream_impl(ctx, params, res, s);
+    fputs(s.c_str(), stderr);
+    if (result) {
+        *result = res;
+    }
+    return ret;
+}
+
+WHISPER_API const char * whisper_bench_stream_str(struct whisper_context * ctx, struct whisper_bench_stream_params params, struct whisper_bench_stream_result * result) {
+    static std::string s;
+    s = "";
+    whisper_bench_stream_result res = {};
+    whisper_bench_stream_impl(ctx, params, res, s);
+    if (result) {
+        *result = res;
+    }
+    return s.c_str();
+}
+
+//
+// thread / threadpool sweep
+//
+
+static int whisper_bench_threads_impl(const whisper_bench_threads_params & bparams, std::string & s) {
+    char strbuf[256];
+
+    if (bparams.path_model == nullptr) {
+        WHISPER_LOG_ERROR("%s: path_model is not set\n", __func__);
+        return -1;
+    }
+
+    const int n_threads_max = bparams.n_threads_max > 0 ? bparams.n_threads_max : std::max(1, (int) std::thread::hardware_concurrency());
+    const int n_encode      = std::max(1, bparams.n_encode);
+    const int n_decode      = std::max(1, std::min(bparams.n_decode, 256));
+
+    std::vector<int> threads;
+    for (int t = 1; t < n_threads_max; t *= 2) {
+        threads.push_back(t);
+    }
+    threads.push_back(n_threads_max);
+
+    const int polls[] = { -1, 0, 50, 100 };
+    const int n_polls = sizeof(polls)/sizeof(polls[0]);
+
+    // [fa][poll][threads] -> ms
+    std::vector<double> t_enc(2*n_polls*threads.size(), 0.0);
+    std::vector<double> t_dec(2*n_polls*threads.size(), 0.0);
+
+    auto idx = [&](int fa, int ip, int it) { return (fa*n_polls + ip)*threads.size() + it; };
+
+    const std::vector<float> pcmf32 = whisper_bench_tone_bursts(30);
+
+    s += "flash_attn  poll  threads   encode (ms)   decode (ms/token)\n";
+
+    for (int fa = 0; fa < 2; ++fa) {
+        whisper_context_params cparams = whisper_context_default_params();
+        cparams.use_gpu    = bparams.use_gpu;
+        cparams.flash_attn = fa == 1;
+
+        whisper_context * ctx = whisper_init_from_file_with_params(bparams.path_model, cparams);
+        if (ctx == nullptr) {
+            WHISPER_LOG_ERROR("%s: failed to load model '%s'\n", __func__, bparams.path_model);
+            return -2;
+        }
+
+        whisper_state * state = ctx->state;
+
+        if (whisper_pcm_to_mel_with_state(ctx, state, pcmf32.data(), pcmf32.size(), n_threads_max) != 0) {
+            whisper_free(ctx);
+            return -3;
+        }
+
+        const whisper_token token = whisper_token_sot(ctx);
+
+        for (int ip = 0; ip < n_polls; ++ip) {
+            for (int it = 0; it < (int) threads.size(); ++it) {
+                const int n_threads = threads[it];
+
+                whisper_state_set_threadpool(*state, n_threads, polls[ip]);
+
+                // warm-up
+                if (!whisper_encode_internal(*ctx, *state, 0, n_threads, nullptr, nullptr) ||
+                    whisper_decode_with_state(ctx, state, &token, 1, 0, n_threads) != 0) {
+                    whisper_free(ctx);
+                    return -4;
+                }
+
+                int64_t t_start_us = ggml_time_us();
+                for (int i = 0; i < n_encode; ++i) {
+                    whisper_encode_internal(*ctx, *state, 0, n_threads, nullptr, nullptr);
+                }
+                t_enc[idx(fa, ip, it)] = 1e-3*(ggml_time_us() - t_start_us)/n_encode;
+
+                t_start_us = ggml_time_us();
+                for (int i = 0; i < n_decode; ++i) {
+                    whisper_decode_with_state(ctx, state, &token, 1, i, n_threads);
+                }
+                t_dec[idx(fa, ip, it)] = 1e-3*(ggml_time_us() - t_start_us)/n_decode;
+
+                snprintf(strbuf, sizeof(strbuf), "%10d  %4s  %7d  %12.2f  %18.3f\n",
+                        fa, polls[ip] < 0 ? "-" : std::to_string(polls[ip]).c_str(), n_threads,
+                        t_enc[idx(fa, ip, it)], t_dec[idx(fa, ip, it)]);
+                s += strbuf;
+            }
+        }
+
+        whisper_free(ctx);
+    }
+
+    // flash-attn and the threadpool are shared by the encoder and the decoder, so they are picked
+    // by the cost of one window: one encoder pass plus n_tokens_window decoded tokens
+    int    best_fa  = 0;
+    int    best_ip  = 0;
+    int    best_enc = 0;
+    int    best_dec = 0;
+    double best_t   = DBL_MAX;
+
+    for (int fa = 0; fa < 2; ++fa) {
+        for (int ip = 0; ip < n_polls; ++ip) {
+            int it_enc = 0;
+            int it_dec = 0;
+            for (int it = 1; it < (int) threads.size(); ++it) {
+                if (t_enc[idx(fa, ip, it)] < t_enc[idx(fa, ip, it_enc)]) it_enc = it;
+                if (t_dec[idx(fa, ip, it)] < t_dec[idx(fa, ip, it_dec)]) it_dec = it;
+            }
+
+            const double t = t_enc[idx(fa, ip, it_enc)] + bparams.n_tokens_window*t_dec[idx(fa, ip, it_dec)];
+            if (t < best_t) {
+                best_t   = t;
+                best_fa  = fa;
+                best_ip  = ip;
+                best_enc = it_enc;
+                best_dec = it_dec;
+            }
+        }
+    }
+
+    std::string config;
+    config += "# generated by whisper_bench_threads, load with whisper_tuning_load()\n";
+    snprintf(strbuf, sizeof(strbuf), "# estimated %.2f ms per window (1 encode + %d tokens)\n", best_t, bparams.n_tokens_window);
+    config += strbuf;
+    snprintf(strbuf, sizeof(strbuf), "flash_attn = %d\n",       best_fa);
+    config += strbuf;
+    snprintf(strbuf, sizeof(strbuf), "n_threads_encode = %d\n", threads[best_enc]);
+    config += strbuf;
+    snprintf(strbuf, sizeof(strbuf), "n_threads_decode = %d\n", threads[best_dec]);
+    config += strbuf;
+    snprintf(strbuf, sizeof(strbuf), "poll = %d\n",             polls[best_ip]);
+    config += strbuf;
+
+    s += "\nrecommended configuration:\n";
+    s += config;
+
+    if (bparams.path_config != nullptr) {
+        std::ofstream fout(bparams.path_config);
+        if (!fout) {
+            WHISPER_LOG_ERROR("%s: failed to open '%s' for writing\n", __func__, bparams.path_config);
+            return -5;
+        }
+        fout << config;
+    }
+
+    return 0;
+}
+
+struct whisper_bench_threads_params whisper_bench_threads_default_params(void) {
+    whisper_bench_threads_params result = {
+        /*.path_model      =*/ nullptr,
+        /*.path_config     =*/ nullptr,
+        /*.n_threads_max   =*/ 0,
+        /*.n_encode        =*/ 2,
+        /*.n_decode        =*/ 64,
+        /*.n_tokens_window =*/ 64,
+        /*.use_gpu         =*/ false,
+    };
+    return result;
+}
+
+WHISPER_API int whisper_bench_threads(struct whisper_bench_threads_params params) {
+    std::string s;
+    const int ret = whisper_bench_threads_impl(params, s);
+    fputs(s.c_str(), stderr);
+    return ret;
+}
+
+WHISPER_API const char * whisper_bench_threads_str(struct whisper_bench_threads_params params) {
+    static std::string s;
+    s = "";
+    whisper_bench_threads_impl(params, s);
+    return s.c_str();
+}
+
+int whisper_tuning_load(const char * path, struct whisper_context_params * cparams, struct whisper_full_params * params) {
+    std::ifstream fin(path);
+    if (!fin) {
+        WHISPER_LOG_ERROR("%s: failed to open '%s'\n", __func__, path);
+        return -1;
+    }
+
+    auto trim = [](const std::string & str) {
+        const size_t b = str.find_first_not_of(" \t\r");
+        const size_t e = str.find_last_not_of(" \t\r");
+        return b == std::string::npos ? std::string() : str.substr(b, e - b + 1);
+    };
+
+    std::string line;
+    int n_line = 0;
+    while (std::getline(fin, line)) {
+        n_line++;
+
+        line = trim(line.substr(0, line.find('#')));
+        if (line.empty()) {
+            continue;
+        }
+
+        const size_t pos = line.find('=');
+        if (pos == std::string::npos) {
+            WHISPER_LOG_ERROR("%s: %s:%d: expected 'key = value'\n", __func__, path, n_line);
+            return -2;
+        }
+
+        const std::string key = trim(line.substr(0, pos));
+        const std::string val = trim(line.substr(pos + 1));
+
+        char * end = nullptr;
+        const long v = strtol(val.c_str(), &end, 10);
+        if (val.empty() || *end != '\0') {
+            WHISPER_LOG_ERROR("%s: %s:%d: invalid value '%s'\n", __func__, path, n_line, val.c_str());
+            return -2;
+        }
+
+        if (key == "flash_attn") {
+            if (cparams) cparams->flash_attn = v != 0;
+        } else if (key == "n_threads") {
+            if (params) params->n_threads = v;
+        } else if (key == "n_threads_encode") {
+            if (params) params->n_threads_encode = v;
+        } else if (key == "n_threads_decode") {
+            if (params) params->n_threads_decode = v;
+        } else if (key == "poll") {
+            if (params) params->poll = v;
+        } else {
+            WHISPER_LOG_WARN("%s: %s:%d: unknown key '%s'\n", __func__, path, n_line, key.c_str());
+        }
+    }
+
+    if (params) {
+        // mel and sampling use the general thread count
+        params->n_threads = std::max({ params->n_threads, params->n_threads_encode, params->n_threads_decode });
+    }
+
+    return 0;
+}
+
+//
+// allocation tracking
+//
+
+static int whisper_bench_allocs_impl(struct whisper_context * ctx, int n_threads, std::string & s) {
+    char strbuf[256];
+
+#ifndef WHISPER_ALLOC_TRACKING
+    s += "allocation tracking is disabled - build with WHISPER_ALLOC_TRACKING defined\n";
+    GGML_UNUSED(ctx);
+    GGML_UNUSED(n_threads);
+    GGML_UNUSED(strbuf);
+    return -1;
+#else
+    const std::vector<float> pcmf32 = whisper_bench_tone_bursts(40);
+
+    const whisper_sampling_strategy strategies[] = { WHISPER_SAMPLING_GREEDY, WHISPER_SAMPLING_BEAM_SEARCH };
+
+    s += "strategy     allocs / call   allocs / step (decode loop)   steps\n";
+
+    for (const auto strategy : strategies) {
+        whisper_full_params params = whisper_full_default_params(strategy);
+
+        params.n_threads       = n_threads;
+        params.language        = "en";
+        params.no_context      = true;
+        params.print_progress  = false;
+        params.temperature_inc = 0.0f;
+
+        whisper_state * state = whisper_init_state(ctx);
+        if (state == nullptr) {
+            return -2;
+        }
+
+        // the first call sizes the buffers of the state, the second one shows the steady state
+        if (whisper_full_with_state(ctx, state, params, pcmf32.data(), pcmf32.size()) != 0) {
+            whisper_free_state(state);
+            return -3;
+        }
+
+        const int64_t n_alloc_decode = state->n_alloc_decode;
+        const int32_t n_decode_steps = state->n_decode_steps;
+
+        const int64_t n_alloc_start = whisper_alloc_count();
+
+        if (whisper_full_with_state(ctx, state, params, pcmf32.data(), pcmf32.size()) != 0) {
+            whisper_free_state(state);
+            return -3;
+        }
+
+        const int64_t n_alloc = whisper_alloc_count() - n_alloc_start;
+        const int32_t n_steps = state->n_decode_steps - n_decode_steps;
+
+        snprintf(strbuf, sizeof(strbuf), "%-8s  %16lld   %27.2f   %5d\n",
+                strategy == WHISPER_SAMPLING_GREEDY ? "greedy" : "beam",
+                (long long) n_alloc, (double) (state->n_alloc_decode - n_alloc_decode)/std::max(1, n_steps), n_steps);
+        s += strbuf;
+
+        whisper_free_state(state);
+    }
+
+    return 0;
+#endif
+}
+
+WHISPER_API int whisper_bench_allocs(struct whisper_context * ctx, int n_threads) {
+    std::string s;
+    const int ret = whisper_bench_allocs_impl(ctx, n_threads, s);
+    fputs(s.c_str(), stderr);
+    return ret;
+}
+
+WHISPER_API const char * whisper_bench_allocs_str(struct whisper_context * ctx, int n_threads) {
+    static std::string s;
+    s = "";
+    whisper_bench_allocs_impl(ctx, n_threads, s);
+    return s.c_str();
+}
+
+// =================================================================================================
+
+// =================================================================================================
+
+//
+// Experimental stuff below
+//
+// Not sure if these should be part of the library at all, because the quality of the results is not
+// guaranteed. Might get removed at some point unless a robust algorithm implementation is found
+//
+
+// =================================================================================================
+
+//
+// token-level timestamps
+//
+
+static int64_t sample_to_timestamp(int i_sample) {
+    return (100ll*i_sample)/WHISPER_SAMPLE_RATE;
+}
+
+// half window of the signal energy, in samples
+#define WHISPER_ENERGY_HW 32
+
+// max span of the energy window, in samples - a segment plus the margins of the token search
+#define WHISPER_ENERGY_WINDOW ((WHISPER_CHUNK_SIZE + 2)*WHISPER_SAMPLE_RATE)
+
+// make the energy of the samples [k0, n) available
+// the prefix sums are extended in steps of one second. They start over at k0 (whole seconds) when k0 is before
+// the window or n is past its max span, so the memory is bounded by WHISPER_ENERGY_WINDOW and not by the input
+static void whisper_energy_extend(whisper_state & state, int k0, int n) {
+    const int hw    = WHISPER_ENERGY_HW;
+    const int n_pcm = state.energy_n_pcm;
+
+    auto & sum  = state.energy_sum;
+    auto & sum2 = state.energy_sum2;
+
+    if (k0 < state.energy_b0 || n > state.energy_b0 + WHISPER_ENERGY_WINDOW) {
+        state.energy_b0 = k0 - k0 % WHISPER_SAMPLE_RATE;
+        sum.clear();
+        sum2.clear();
+    }
+
+    const int b0 = state.energy_b0;
+    const int p0 = std::max(b0 - hw, 0);
+
+    if (b0 + (int) sum2.size() > n) {
+        return;
+    }
+
+    n = std::min(b0 + GGML_PAD(n - b0, WHISPER_SAMPLE_RATE), n_pcm);
+
+    // the energy of sample k needs |pcm| up to k + hw
+    const int n1 = std::min(n + hw, n_pcm);
+
+    if (sum.empty()) {
+        sum.reserve(n1 - p0 + 1);
+        sum.push_back(0.0);
+    }
+    for (int k = p0 + sum.size() - 1; k < n1; ++k) {
+        sum.push_back(sum.back() + fabs(state.energy_pcm[k]));
+    }
+
+    if (sum2.empty()) {
+        sum2.reserve(n - b0 + 1);
+        sum2.push_back(0.0);
+    }
+    for (int k = b0 + sum2.size() - 1; k < n; ++k) {
+        const int k0 = std::max(k - hw, 0);
+        const int k1 = std::min(k + hw + 1, n_pcm);
+        sum2.push_back(sum2.back() + (float) ((sum[k1 - p0] - sum[k0 - p0])/(2*hw + 1)));
+    }
+}
+
+// average of the fabs of the signal in a window around sample k
+static float whisper_energy(whisper_state & state, int k) {
+    const int hw = WHISPER_ENERGY_HW;
+
+    if (k < state.energy_b0 || k + 1 >= state.energy_b0 + (int) state.energy_sum2.size()) {
+        whisper_energy_extend(state, k, k + 1);
+    }
+
+    const int p0 = std::max(state.energy_b0 - hw, 0);
+    const int k0 = std::max(k - hw, 0);
+    const int k1 = std::min(k + hw + 1, state.energy_n_pcm);
+
+    return (state.energy_sum[k1 - p0] - state.energy_sum[k0 - p0])/(2*hw + 1);
+}
+
+static int timestamp_to_sample(int64_t t, int64_t segment_t0, int n_samples) {
+    // Convert absolute timestamp to segment-relative timestamp
+    int64_t relative_t = t - segment_t0;
+    int sample = (int)((relative_t * WHISPER_SAMPLE_RATE) / 100);
+    return std::max(0, std::min(n_samples - 1, sample));
+}
+
+static int64_t sample_to_timestamp(int i_sample, int64_t segment_t0) {
+    int64_t relative_timestamp = (100ll * i_sample) / WHISPER_SAMPLE_RATE;
+    return relative_timestamp + segment_t0;
+}
+
+static void whisper_exp_compute_token_level_timestamps(
+        struct whisper_context & ctx,
+          struct whisper_state & state,
+                           int   i_segment,
+                         float   thold_pt,
+                         float   thold_ptsum) {
+    auto & segment = state.result_all[i_segment];
+    auto & tokens  = segment.tokens;
+
+    const int n_samples = state.energy_n_pcm;
+
+    if (n_samples == 0) {
+        WHISPER_LOG_ERROR("%s: no signal data available\n", __func__);
+        return;
+    }
+
+    const int64_t t0 = segment.t0;
+    const int64_t t1 = segment.t1;
+
+    const int n = tokens.size();
+
+    if (n == 0) {
+        return;
+    }
+
+    if (n == 1) {
+        tokens[0].t0 = t0;
+        tokens[0].t1 = t1;
+
+        return;
+    }
+
+    auto & t_beg    = state.t_beg;
+    auto & t_last   = state.t_last;
+    auto & tid_last = state.tid_last;
+
+    for (int j = 0; j < n; ++j) {
+        auto & token = tokens[j];
+
+        if (j == 0) {
+            if (token.id == whisper_token_beg(&ctx)) {
+                tokens[j    ].t0 = t0;
+                tokens[j    ].t1 = t0;
+                tokens[j + 1].t0 = t0;
+
+                t_beg    = t0;
+                t_last   = t0;
                 tid_last = whisper_token_beg(&ctx);
             } else {
                 tokens[j    ].t0 = t_last;
@@ -8477,7 +11490,7 @@ static void whisper_exp_compute_token_level_timestamps(
 
         const int64_t tt = t_beg + 2*(token.tid - whisper_token_beg(&ctx));
 
-        tokens[j].vlen = voice_length(whisper_token_to_str(&ctx, token.id));
+        tokens[j].vlen = ctx.vocab.token_vlen[token.id];
 
         if (token.pt > thold_pt && token.ptsum > thold_ptsum && token.tid > tid_last && tt <= t1) {
             if (j > 0) {
@@ -8570,18 +11583,16 @@ static void whisper_exp_compute_token_level_timestamps(
 
             const int ns = ss1 - ss0;
 
-            float sum = 0.0f;
+            whisper_energy_extend(state, ss0, std::max(ss1, s1 + 1));
 
-            for (int k = ss0; k < ss1; k++) {
-                sum += state.energy[k];
-            }
+            const float sum = state.energy_sum2[ss1 - state.energy_b0] - state.energy_sum2[ss0 - state.energy_b0];
 
             const float thold = 0.5*sum/ns;
 
             {
                 int k = s0;
-                if (state.energy[k] > thold && j > 0) {
-                    while (k > 0 && state.energy[k] > thold) {
+                if (whisper_energy(state, k) > thold && j > 0) {
+                    while (k > 0 && whisper_energy(state, k) > thold) {
                         k--;
                     }
                     tokens[j].t0 = sample_to_timestamp(k, segment.t0);
@@ -8591,7 +11602,7 @@ static void whisper_exp_compute_token_level_timestamps(
                         s0 = k;
                     }
                 } else {
-                    while (state.energy[k] < thold && k < s1) {
+                    while (whisper_energy(state, k) < thold && k < s1) {
                         k++;
                     }
                     s0 = k;
@@ -8601,8 +11612,8 @@ static void whisper_exp_compute_token_level_timestamps(
 
             {
                 int k = s1;
-                if (state.energy[k] > thold) {
-                    while (k < n_samples - 1 && state.energy[k] > thold) {
+                if (whisper_energy(state, k) > thold) {
+                    while (k < n_samples - 1 && whisper_energy(state, k) > thold) {
                         k++;
                     }
                     tokens[j].t1 = sample_to_timestamp(k, segment.t0);
@@ -8612,7 +11623,7 @@ static void whisper_exp_compute_token_level_timestamps(
                         s1 = k;
                     }
                 } else {
-                    while (state.energy[k] < thold && k > s0) {
+                    while (whisper_energy(state, k) < thold && k > s0) {
                         k--;
                     }
                     s1 = k;
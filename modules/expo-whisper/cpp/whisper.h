@@ -80,6 +80,7 @@ extern "C" {
     struct whisper_context;
     struct whisper_state;
     struct whisper_full_params;
+    struct whisper_scheduler;
 
     typedef int32_t whisper_pos;
     typedef int32_t whisper_token;
@@ -126,6 +127,18 @@ extern "C" {
         struct whisper_aheads dtw_aheads;
 
         size_t dtw_mem_size; // TODO: remove
+
+        // [EXPERIMENTAL] Keep the layer weights in the memory-mapped model file instead of loading them into memory
+        // The weights of the next encoder layers are paged in ahead of the computation and the pages of the layers
+        // behind it are released, so only a few encoder layers are resident at a time. The decoder layers stay resident
+        // while a window is decoded and are released once its decoding is done. Trades throughput for memory.
+        // Matrices that are not aligned in the model file are loaded into memory (counted in the load log)
+        // Only for whisper_init_from_file_with_params* with the weights on the CPU, ignored otherwise
+        bool low_memory;
+
+        // Type of the KV caches and of the attention intermediates: GGML_TYPE_F16 (default), GGML_TYPE_BF16 or GGML_TYPE_F32
+        // BF16 has the range of F32 at the size of F16, for models whose activations overflow F16 (e.g. large-v3)
+        enum ggml_type type_kv;
     };
 
     typedef struct whisper_token_data {
@@ -339,6 +352,17 @@ extern "C" {
                                int   n_past,
                                int   n_threads);
 
+    // Restrict the decoding to a shortlist of the vocabulary, e.g. the tokens of the only language of an app
+    // The shortlist holds the given tokens and all the special and timestamp tokens. Their rows of the token embedding are
+    // copied into a separate tensor, so that the decoder computes the logits only for them when
+    // whisper_full_params.vocab_shortlist is set. The other tokens get -INFINITY logits.
+    // Pass NULL to remove the shortlist. Must not be called while the context is decoding
+    // Returns 0 on success
+    WHISPER_API int whisper_set_vocab_shortlist(
+            struct whisper_context * ctx,
+               const whisper_token * tokens,
+                               int   n_tokens);
+
     // Convert the provided text into tokens.
     // The tokens pointer must be large enough to hold the resulting tokens.
     // Returns the number of tokens on success, no more than n_max_tokens
@@ -441,6 +465,21 @@ extern "C" {
         float decode_ms;
         float batchd_ms;
         float prompt_ms;
+
+        // CPU-side work of the decode loop, ms per call (summed over sampling threads)
+        float logits_ms;   // logit filtering, incl. grammar
+        float softmax_ms;  // log-softmax / softmax over the vocabulary
+        float sampling_ms; // token selection
+        float beam_ms;     // beam candidates, merge and decoder copies
+        float kv_ms;       // KV cache bookkeeping
+        float segment_ms;  // segment and timestamp extraction (per window)
+
+        int n_logits;
+        int n_softmax;
+        int n_sampling;
+        int n_beam;
+        int n_kv;
+        int n_segment;
     };
     WHISPER_API struct whisper_timings * whisper_get_timings(struct whisper_context * ctx);
     WHISPER_API void whisper_print_timings(struct whisper_context * ctx);
@@ -488,6 +527,9 @@ extern "C" {
         enum whisper_sampling_strategy strategy;
 
         int n_threads;
+        int n_threads_encode;   // threads used by the encoder (0 = n_threads)
+        int n_threads_decode;   // threads used by the decoder (0 = n_threads)
+        int poll;               // polling level (0-100) of a persistent per-state threadpool (-1 = create one per graph)
         int n_max_text_ctx;     // max tokens to use from past text as prompt for the decoder
         int offset_ms;          // start offset in ms
         int duration_ms;        // audio duration to process in ms
@@ -586,8 +628,37 @@ extern "C" {
         // Voice Activity Detection (VAD) params
         bool         vad;                         // Enable VAD
         const char * vad_model_path;              // Path to VAD model
+        bool         vad_schedule;                // Decode the speech segments in place, packed into 30 s windows, instead of
+                                                  // concatenating them into a new buffer (timestamps need no remapping)
+                                                  // A window covers the silence between the segments packed into it
+                                                  // new_segment_callback sees one window at a time in the state, so the
+                                                  // segment indices are relative to the current window
 
         whisper_vad_params vad_params;
+
+        // Share the threads with other whisper_full calls that use the same scheduler (see whisper_scheduler_init)
+        struct whisper_scheduler * scheduler;
+        int scheduler_priority;    // higher priorities get their threads first, e.g. live captions over file imports
+        int scheduler_deadline_ms; // among equal priorities, the earliest deadline (from the start of the call) goes first, 0 = none
+
+        // Decode with the vocabulary shortlist of the context (see whisper_set_vocab_shortlist)
+        // When the best token has a lower log probability than vocab_shortlist_logprob_thold within the shortlist, the
+        // logits of the token are computed again over the full vocabulary
+        bool  vocab_shortlist;
+        float vocab_shortlist_logprob_thold;
+
+        // Phrases to recognize more reliably, e.g. product names or medical terms
+        // Every token that starts a phrase or continues the part of a phrase that ends the decoded text gets
+        // hotword_boost added to its logit. A phrase starts with a space, except at the start of the text or after
+        // a timestamp. Unlike initial_prompt, this does not make the prompt longer
+        const char ** hotwords;
+        int           n_hotwords;
+        float         hotword_boost;
+
+        // Position of samples[0] in a live audio stream, in samples (-1 = not part of a stream)
+        // Consecutive calls with overlapping audio, e.g. live captions, reuse the encoder conv stem output of the
+        // audio that has not changed since the previous call on the same state
+        int64_t stream_offset_samples;
     };
 
     // NOTE: this function allocates memory, and it is the responsibility of the caller to free the pointer - see whisper_free_context_params & whisper_free_params()
@@ -625,6 +696,63 @@ extern "C" {
                                    int   n_samples,
                                    int   n_processors);
 
+    // One input of whisper_full_batch()
+    struct whisper_batch_input {
+        const float * samples;
+        int           n_samples;
+        void        * user_data; // passed to the result callback
+    };
+
+    // Called from a worker thread of whisper_full_batch() once an input has been transcribed
+    // result is the return value of whisper_full() for the input
+    // The segments can be read from the state with the whisper_full_*_from_state() functions until the callback returns
+    // The callbacks of different inputs can run at the same time
+    typedef void (*whisper_batch_result_callback)(
+            struct whisper_context * ctx,
+              struct whisper_state * state,
+                               int   i_input,
+                               int   result,
+                              void * input_user_data,
+                              void * user_data);
+
+    struct whisper_batch_params {
+        int n_threads;            // total number of threads, 0 = hardware concurrency
+        int n_states;             // number of states (and worker threads) in the pool, 0 = 2
+                                  // each state holds its own KV caches and compute buffer, raise with care on mobile
+        int n_samples_per_thread; // an input asks for one thread per this many samples, 0 = 30 s
+
+        whisper_batch_result_callback result_callback;
+        void * result_callback_user_data;
+    };
+
+    WHISPER_API struct whisper_batch_params whisper_batch_default_params(void);
+
+    // Scheduler that divides a budget of n_threads between the whisper_full calls that run at the same time with it
+    // Before every window and every decoder step, a call asks for its n_threads_encode / n_threads_decode, and before
+    // the language detection for its n_threads_encode. The calls are served by priority and deadline, and a call that
+    // gets no thread waits there until the calls that go first finish their graphs. A call only holds its threads while one of its graphs is computed: sampling and the other
+    // CPU-side work between graphs do not count against the budget. A call that has been outranked keeps its threads
+    // until the graph it is computing is done, so a preemption takes at most one encoder or decoder graph.
+    WHISPER_API struct whisper_scheduler * whisper_scheduler_init(int n_threads);
+    WHISPER_API void                       whisper_scheduler_free(struct whisper_scheduler * scheduler);
+
+    // Transcribe many independent inputs with the same parameters, e.g. a queue of voice notes
+    // The inputs are spread over a pool of states, longest first, and idle workers steal queued inputs from the others.
+    // Each input runs whisper_full() on a state of the pool (including the VAD step of params, with the VAD model
+    // loaded once per state) with as many threads as its length asks for, taken from a budget of n_threads shared by
+    // all workers, so a long input that gets several threads leaves fewer workers running. params.n_threads_encode /
+    // n_threads_decode are clamped to the threads an input gets.
+    // Every state has its own KV caches and compute buffer, so n_states also bounds the memory use.
+    // The default state of the context is one of the states of the pool, so its results are overwritten.
+    // params.new_segment_callback and params.progress_callback are called from the worker threads.
+    // Returns 0 on success, the number of inputs that failed, or -1 on error
+    WHISPER_API int whisper_full_batch(
+                struct whisper_context * ctx,
+            struct whisper_full_params   params,
+      const struct whisper_batch_input * inputs,
+                                   int   n_inputs,
+           struct whisper_batch_params   batch_params);
+
     // Number of generated text segments
     // A segment can be a few words, a sentence, or even a paragraph.
     WHISPER_API int whisper_full_n_segments           (struct whisper_context * ctx);
@@ -727,6 +855,109 @@ extern "C" {
     WHISPER_API int          whisper_bench_ggml_mul_mat    (int n_threads);
     WHISPER_API const char * whisper_bench_ggml_mul_mat_str(int n_threads);
 
+    // Regression suite over a fixed corpus of synthetic clips (silence, tones, sweeps, tone bursts) plus optional
+    // user-provided fixtures. Each clip is transcribed with greedy, beam search (5), token timestamps, VAD and
+    // several audio_ctx buckets. RTF and tokens/s are reported for every run and the transcripts / timestamps
+    // are compared against a golden file, which is created from the current results if it does not exist yet.
+    // Decoding is deterministic (temperature fallback disabled, no text context between runs).
+    // Uses the default state of the context.
+    struct whisper_bench_clip {
+        const char  * name;
+        const float * samples;
+        int           n_samples;
+    };
+
+    struct whisper_bench_params {
+        int n_threads;
+
+        const char * path_golden;    // golden outputs (nullptr = do not compare)
+        const char * vad_model_path; // the VAD configuration is skipped if nullptr
+
+        int ts_tolerance_ms;         // allowed deviation of the timestamps from the golden outputs
+
+        const struct whisper_bench_clip * clips; // additional clips, e.g. bundled speech fixtures
+        int                               n_clips;
+    };
+
+    WHISPER_API struct whisper_bench_params whisper_bench_default_params(void);
+
+    // Returns the number of runs that do not match the golden outputs, or negative on failure
+    WHISPER_API int          whisper_bench_full    (struct whisper_context * ctx, struct whisper_bench_params params);
+    WHISPER_API const char * whisper_bench_full_str(struct whisper_context * ctx, struct whisper_bench_params params);
+
+    // Streaming latency benchmark. Replays the audio at the given pace into a sliding-window realtime loop
+    // (step / length / keep, single segment, no context - same as the chunked realtime path) on a separate state
+    // and measures how long it takes for each word to be emitted after it was spoken, how often partial results
+    // are revised before being committed, CPU utilization and how much audio is dropped when transcription
+    // can't keep up with the capture buffer.
+    struct whisper_bench_stream_params {
+        int   n_threads;
+        int   step_ms;      // audio chunk size
+        int   length_ms;    // window length - the text is committed when the window is full
+        int   keep_ms;      // audio kept from the previous window when committing
+        int   buffer_ms;    // capture buffer - older audio is dropped when transcription falls behind
+        int   audio_ctx;    // 0 = use default
+        float speed;        // replay pace (1.0 = real time, 2.0 = twice as fast, ...)
+
+        const char  * language;
+        const float * samples;   // audio to replay (nullptr = synthetic tone bursts)
+        int           n_samples;
+    };
+
+    struct whisper_bench_stream_result {
+        int   n_emitted;     // words emitted in partial results
+        int   n_revised;     // emitted words that changed in a later partial result
+        int   n_committed;   // words in the committed text
+
+        float emit_p50_ms;   // delay from the end of a word in the audio until it is first emitted
+        float emit_p90_ms;
+        float emit_max_ms;
+        float commit_p50_ms; // delay from the end of a word in the audio until it is committed
+        float commit_p90_ms;
+        float commit_max_ms;
+
+        float revision_rate; // n_revised / n_emitted
+        float cpu_util;      // process CPU time / wall time (1.0 = one core fully busy)
+        float dropped_ms;    // audio dropped because transcription fell behind
+    };
+
+    WHISPER_API struct whisper_bench_stream_params whisper_bench_stream_default_params(void);
+
+    // If result is not NULL, it is filled with the measured values. Returns 0 on success
+    WHISPER_API int          whisper_bench_stream    (struct whisper_context * ctx, struct whisper_bench_stream_params params, struct whisper_bench_stream_result * result);
+    WHISPER_API const char * whisper_bench_stream_str(struct whisper_context * ctx, struct whisper_bench_stream_params params, struct whisper_bench_stream_result * result);
+
+    // Thread / threadpool sweep
+    // Times the encoder and the decoder separately for thread counts 1, 2, 4, ... n_threads_max, for
+    // threadpool polling levels (none, 0, 50, 100) and with flash-attention on and off, then writes
+    // the fastest combination to path_config in the format read by whisper_tuning_load()
+
+    struct whisper_bench_threads_params {
+        const char * path_model;
+        const char * path_config;  // recommended configuration (nullptr = do not write)
+
+        int  n_threads_max;        // 0 = hardware concurrency
+        int  n_encode;             // timed encoder runs per configuration
+        int  n_decode;             // timed single-token decoder runs per configuration
+        int  n_tokens_window;      // decoded tokens per encoded window, weighs encoder vs decoder time
+        bool use_gpu;
+    };
+
+    WHISPER_API struct whisper_bench_threads_params whisper_bench_threads_default_params(void);
+
+    WHISPER_API int          whisper_bench_threads    (struct whisper_bench_threads_params params);
+    WHISPER_API const char * whisper_bench_threads_str(struct whisper_bench_threads_params params);
+
+    // Apply a configuration written by whisper_bench_threads() ("key = value" lines, '#' starts a comment)
+    // Either of cparams / params can be NULL. Returns 0 on success
+    WHISPER_API int whisper_tuning_load(const char * path, struct whisper_context_params * cparams, struct whisper_full_params * params);
+
+    // Heap allocations of whisper_full with greedy and beam-search decoding, in total and per step of the
+    // decode loop, measured on the second call with the same state
+    // Requires a build with WHISPER_ALLOC_TRACKING defined, returns -1 otherwise
+    WHISPER_API int          whisper_bench_allocs    (struct whisper_context * ctx, int n_threads);
+    WHISPER_API const char * whisper_bench_allocs_str(struct whisper_context * ctx, int n_threads);
+
     // Control logging output; default behavior is to print to stderr
 
     WHISPER_API void whisper_log_set(ggml_log_callback log_callback, void * user_data);
@@ -0,0 +1,157 @@
+// the CPU backend keeps the converted src1 of a mul_mat in the work buffer for the next mul_mat with the same src1
+// (see ggml_compute_forward_mul_mat), each case is computed as one graph and as one graph per node, which never reuses
+// the cases: Q, K and V sharing src1, an in-place op writing into src1 between two mul_mats, and ops that use the
+// work buffer (SOFT_MAX, FLASH_ATTN_EXT) between two mul_mats
+
+#include "ggml.h"
+#include "ggml-cpu.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+enum reuse_case { REUSE_QKV, REUSE_INPLACE, REUSE_SOFT_MAX, REUSE_FLASH_ATTN, REUSE_COUNT };
+
+static const char * case_names[REUSE_COUNT] = { "qkv", "inplace", "soft_max", "flash_attn" };
+
+static const int n_embd   = 256;
+static const int n_tokens = 8;
+
+static void fill(ggml_tensor * t, float seed) {
+    const int64_t n = ggml_nelements(t);
+
+    std::vector<float> data(n);
+    for (int64_t i = 0; i < n; ++i) {
+        data[i] = sinf(0.37f*i + seed) + 0.25f*cosf(0.011f*i*seed);
+    }
+
+    if (t->type == GGML_TYPE_F32) {
+        memcpy(t->data, data.data(), n*sizeof(float));
+    } else if (t->type == GGML_TYPE_F16) {
+        ggml_fp32_to_fp16_row(data.data(), (ggml_fp16_t *) t->data, n);
+    } else {
+        ggml_quantize_chunk(t->type, data.data(), t->data, 0, ggml_nrows(t), t->ne[0], nullptr);
+    }
+}
+
+// outputs of the mul_mats of the case
+static bool run(ggml_type wtype, reuse_case c, bool whole, int n_threads, std::vector<std::vector<float>> & out) {
+    ggml_init_params params = { 32u*1024*1024, nullptr, false };
+    ggml_context * ctx = ggml_init(params);
+    if (!ctx) {
+        return false;
+    }
+
+    ggml_tensor * x = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_embd, n_tokens);
+    fill(x, 1.0f);
+
+    ggml_tensor * w[3];
+    for (int i = 0; i < 3; ++i) {
+        w[i] = ggml_new_tensor_2d(ctx, wtype, n_embd, n_embd);
+        fill(w[i], 2.0f + i);
+    }
+
+    // the nodes in the order in which they are computed
+    std::vector<ggml_tensor *> nodes;
+    std::vector<ggml_tensor *> outputs;
+
+    auto mul_mat = [&](ggml_tensor * wi) {
+        ggml_tensor * y = ggml_mul_mat(ctx, wi, x);
+        nodes.push_back(y);
+        outputs.push_back(y);
+    };
+
+    switch (c) {
+        case REUSE_QKV:
+            {
+                mul_mat(w[0]);
+                mul_mat(w[1]);
+                mul_mat(w[2]);
+            } break;
+        case REUSE_INPLACE:
+            {
+                mul_mat(w[0]);
+                nodes.push_back(ggml_scale_inplace(ctx, x, 0.5f));
+                mul_mat(w[1]);
+            } break;
+        case REUSE_SOFT_MAX:
+            {
+                // wider than the converted src1, so that the whole of it is overwritten
+                ggml_tensor * t = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, 4*n_embd*n_tokens, 2);
+                fill(t, 5.0f);
+
+                mul_mat(w[0]);
+                nodes.push_back(ggml_soft_max(ctx, t));
+                mul_mat(w[1]);
+            } break;
+        case REUSE_FLASH_ATTN:
+            {
+                ggml_tensor * q = ggml_new_tensor_3d(ctx, GGML_TYPE_F32, 64, n_tokens, 4);
+                ggml_tensor * k = ggml_new_tensor_3d(ctx, GGML_TYPE_F16, 64, 256,      4);
+                ggml_tensor * v = ggml_new_tensor_3d(ctx, GGML_TYPE_F16, 64, 256,      4);
+                fill(q, 6.0f);
+                fill(k, 7.0f);
+                fill(v, 8.0f);
+
+                mul_mat(w[0]);
+                nodes.push_back(ggml_flash_attn_ext(ctx, q, k, v, nullptr, 0.125f, 0.0f, 0.0f));
+                mul_mat(w[1]);
+            } break;
+        default:
+            ggml_free(ctx);
+            return false;
+    }
+
+    bool ok = true;
+
+    if (whole) {
+        ggml_cgraph * gf = ggml_new_graph(ctx);
+        for (auto * node : nodes) {
+            ggml_build_forward_expand(gf, node);
+        }
+        ok = ggml_graph_compute_with_ctx(ctx, gf, n_threads) == GGML_STATUS_SUCCESS;
+    } else {
+        for (auto * node : nodes) {
+            ggml_cgraph * gf = ggml_new_graph(ctx);
+            ggml_build_forward_expand(gf, node);
+            ok = ok && ggml_graph_compute_with_ctx(ctx, gf, n_threads) == GGML_STATUS_SUCCESS;
+        }
+    }
+
+    out.clear();
+    for (auto * y : outputs) {
+        out.emplace_back((const float *) y->data, (const float *) y->data + ggml_nelements(y));
+    }
+
+    ggml_free(ctx);
+
+    return ok;
+}
+
+int main(int argc, char ** argv) {
+    const int n_threads = argc > 1 ? atoi(argv[1]) : 4;
+
+    int n_fail = 0;
+
+    for (ggml_type wtype : { GGML_TYPE_F16, GGML_TYPE_Q4_0, GGML_TYPE_Q8_0 }) {
+        for (int c = 0; c < REUSE_COUNT; ++c) {
+            std::vector<std::vector<float>> out_whole;
+            std::vector<std::vector<float>> out_nodes;
+
+            const char * res = "OK";
+            if (!run(wtype, (reuse_case) c, true, n_threads, out_whole) || !run(wtype, (reuse_case) c, false, n_threads, out_nodes)) {
+                res = "FAILED TO COMPUTE";
+            } else if (out_whole != out_nodes) {
+                res = "MISMATCH";
+            }
+
+            printf("%-6s %-12s %s\n", ggml_type_name(wtype), case_names[c], res);
+
+            n_fail += strcmp(res, "OK") == 0 ? 0 : 1;
+        }
+    }
+
+    return n_fail == 0 ? 0 : 1;
+}
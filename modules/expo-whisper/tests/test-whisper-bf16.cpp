@@ -0,0 +1,412 @@
+// BF16 accuracy against F16: the F16 tensors of a ggml model are converted to BF16 in memory (round to nearest even)
+// and the BF16 model is run with type_kv = GGML_TYPE_BF16 next to the F16 model with the default F16 KV type
+// the logits of the first decoding step have to be within a tolerance of the F16 ones, and with a real model the
+// greedy transcripts have to be the same. The conv weights of the BF16 model go through the BF16 -> F16 conversion
+// at load time
+//
+// usage: test-whisper-bf16 [ggml-model-f16.bin]
+// without a model, a small model with random weights is generated - its transcripts are not meaningful and are not
+// compared
+
+#include "whisper.h"
+#include "ggml.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <string>
+#include <vector>
+
+// allowed max |logit - logit_f16|, relative to max |logit_f16|
+#define TEST_BF16_TOLERANCE 0.05f
+
+#define TEST_SAMPLE_RATE 16000
+
+struct test_writer {
+    std::vector<uint8_t> & buf;
+
+    template <typename T>
+    void put(const T & v) {
+        const uint8_t * p = (const uint8_t *) &v;
+        buf.insert(buf.end(), p, p + sizeof(T));
+    }
+
+    void put(const void * data, size_t size) {
+        const uint8_t * p = (const uint8_t *) data;
+        buf.insert(buf.end(), p, p + size);
+    }
+};
+
+// English-only model with the vocabulary size of tiny.en and a 64-wide, 2 + 3 layer transformer
+static std::vector<uint8_t> test_model_random() {
+    const int32_t n_vocab     = 51864;
+    const int32_t n_audio_ctx = 1500;
+    const int32_t n_state     = 64;
+    const int32_t n_head      = 2;
+    const int32_t n_alayer    = 2;
+    const int32_t n_text_ctx  = 448;
+    const int32_t n_tlayer    = 3;
+    const int32_t n_mels      = 80;
+    const int32_t n_fft       = 201;
+
+    std::vector<uint8_t> buf;
+    test_writer w { buf };
+
+    std::mt19937 rng(1);
+    std::normal_distribution<float> gauss(0.0f, 1.0f);
+
+    w.put<uint32_t>(0x67676d6c); // ggml
+    for (int32_t v : { n_vocab, n_audio_ctx, n_state, n_head, n_alayer, n_text_ctx, n_state, n_head, n_tlayer, n_mels, 1 }) {
+        w.put(v);
+    }
+
+    w.put(n_mels);
+    w.put(n_fft);
+    for (int i = 0; i < n_mels*n_fft; ++i) {
+        w.put(0.01f*std::uniform_real_distribution<float>(0.0f, 1.0f)(rng));
+    }
+
+    const int32_t n_tokens = 50256;
+    w.put(n_tokens);
+    for (int i = 0; i < n_tokens; ++i) {
+        const std::string s = i < 95 ? std::string(1, (char) (32 + i)) : " w" + std::to_string(i);
+        w.put((uint32_t) s.size());
+        w.put(s.data(), s.size());
+    }
+
+    enum { INIT_W, INIT_ONE, INIT_SMALL };
+
+    auto tensor = [&](const std::string & name, std::vector<int32_t> ne, bool f16, int init = INIT_W) {
+        w.put((int32_t) ne.size());
+        w.put((int32_t) name.size());
+        w.put((int32_t) (f16 ? 1 : 0));
+        int64_t n = 1;
+        for (int32_t d : ne) {
+            w.put(d);
+            n *= d;
+        }
+        w.put(name.data(), name.size());
+        for (int64_t i = 0; i < n; ++i) {
+            const float v = init == INIT_ONE ? 1.0f : init == INIT_SMALL ? 0.02f*gauss(rng) : 0.15f*gauss(rng);
+            if (f16) {
+                w.put(ggml_fp32_to_fp16(v));
+            } else {
+                w.put(v);
+            }
+        }
+    };
+
+    const int32_t S = n_state;
+
+    auto block = [&](const std::string & p, bool cross) {
+        tensor(p + "mlp_ln.weight", { S }, false, INIT_ONE);
+        tensor(p + "mlp_ln.bias",   { S }, false, INIT_SMALL);
+        tensor(p + "mlp.0.weight",  { S, 4*S }, true);
+        tensor(p + "mlp.0.bias",    { 4*S }, false, INIT_SMALL);
+        tensor(p + "mlp.2.weight",  { 4*S, S }, true);
+        tensor(p + "mlp.2.bias",    { S }, false, INIT_SMALL);
+        for (const char * a : { "attn", "cross_attn" }) {
+            if (!cross && strcmp(a, "cross_attn") == 0) {
+                continue;
+            }
+            tensor(p + a + "_ln.weight",      { S }, false, INIT_ONE);
+            tensor(p + a + "_ln.bias",        { S }, false, INIT_SMALL);
+            tensor(p + a + ".query.weight",   { S, S }, true);
+            tensor(p + a + ".query.bias",     { S }, false, INIT_SMALL);
+            tensor(p + a + ".key.weight",     { S, S }, true);
+            tensor(p + a + ".value.weight",   { S, S }, true);
+            tensor(p + a + ".value.bias",     { S }, false, INIT_SMALL);
+            tensor(p + a + ".out.weight",     { S, S }, true);
+            tensor(p + a + ".out.bias",       { S }, false, INIT_SMALL);
+        }
+    };
+
+    tensor("encoder.positional_embedding", { S, n_audio_ctx }, false);
+    tensor("encoder.conv1.weight", { 3, n_mels, S }, true);
+    tensor("encoder.conv1.bias",   { 1, S }, false, INIT_SMALL);
+    tensor("encoder.conv2.weight", { 3, S, S }, true);
+    tensor("encoder.conv2.bias",   { 1, S }, false, INIT_SMALL);
+    tensor("encoder.ln_post.weight", { S }, false, INIT_ONE);
+    tensor("encoder.ln_post.bias",   { S }, false, INIT_SMALL);
+    for (int i = 0; i < n_alayer; ++i) {
+        block("encoder.blocks." + std::to_string(i) + ".", false);
+    }
+
+    tensor("decoder.positional_embedding",   { S, n_text_ctx }, false);
+    tensor("decoder.token_embedding.weight", { S, n_vocab }, true);
+    tensor("decoder.ln.weight", { S }, false, INIT_ONE);
+    tensor("decoder.ln.bias",   { S }, false, INIT_SMALL);
+    for (int i = 0; i < n_tlayer; ++i) {
+        block("decoder.blocks." + std::to_string(i) + ".", true);
+    }
+
+    return buf;
+}
+
+// copy of an F16 ggml model with all F16 tensors converted to BF16, empty on failure
+static std::vector<uint8_t> test_model_to_bf16(const std::vector<uint8_t> & src) {
+    size_t offs = 0;
+
+    auto get = [&](void * dst, size_t size) {
+        if (offs + size > src.size()) {
+            return false;
+        }
+        memcpy(dst, src.data() + offs, size);
+        offs += size;
+        return true;
+    };
+
+    std::vector<uint8_t> dst;
+    test_writer w { dst };
+
+    uint32_t magic = 0;
+    int32_t hparams[11];
+    if (!get(&magic, sizeof(magic)) || magic != 0x67676d6c || !get(hparams, sizeof(hparams))) {
+        fprintf(stderr, "%s: not a ggml model\n", __func__);
+        return {};
+    }
+    if (hparams[10] % GGML_QNT_VERSION_FACTOR != GGML_FTYPE_MOSTLY_F16) {
+        fprintf(stderr, "%s: the model is not F16 (ftype = %d)\n", __func__, hparams[10]);
+        return {};
+    }
+    hparams[10] = GGML_FTYPE_MOSTLY_BF16;
+
+    w.put(magic);
+    w.put(hparams, sizeof(hparams));
+
+    // mel filters and vocabulary are copied as they are
+    {
+        const size_t o0 = offs;
+
+        int32_t n_mel = 0;
+        int32_t n_fft = 0;
+        if (!get(&n_mel, sizeof(n_mel)) || !get(&n_fft, sizeof(n_fft))) {
+            return {};
+        }
+        offs += sizeof(float)*n_mel*n_fft;
+
+        int32_t n_vocab = 0;
+        if (!get(&n_vocab, sizeof(n_vocab))) {
+            return {};
+        }
+        for (int i = 0; i < n_vocab; ++i) {
+            uint32_t len = 0;
+            if (!get(&len, sizeof(len))) {
+                return {};
+            }
+            offs += len;
+        }
+
+        if (offs > src.size()) {
+            return {};
+        }
+        w.put(src.data() + o0, offs - o0);
+    }
+
+    while (offs < src.size()) {
+        int32_t n_dims = 0;
+        int32_t length = 0;
+        int32_t ttype  = 0;
+        if (!get(&n_dims, sizeof(n_dims)) || !get(&length, sizeof(length)) || !get(&ttype, sizeof(ttype)) || n_dims < 1 || n_dims > 4) {
+            return {};
+        }
+
+        int32_t ne[4] = { 1, 1, 1, 1 };
+        if (!get(ne, sizeof(int32_t)*n_dims)) {
+            return {};
+        }
+
+        std::string name(length, 0);
+        if (!get(&name[0], length)) {
+            return {};
+        }
+
+        const int64_t n = (int64_t) ne[0]*ne[1]*ne[2]*ne[3];
+        const size_t  size = ttype == GGML_TYPE_F16 ? n*sizeof(ggml_fp16_t) : ggml_row_size((ggml_type) ttype, ne[0])*(n/ne[0]);
+
+        if (offs + size > src.size()) {
+            return {};
+        }
+
+        w.put((int32_t) n_dims);
+        w.put((int32_t) length);
+        w.put((int32_t) (ttype == GGML_TYPE_F16 ? GGML_TYPE_BF16 : ttype));
+        w.put(ne, sizeof(int32_t)*n_dims);
+        w.put(name.data(), length);
+
+        if (ttype == GGML_TYPE_F16) {
+            const ggml_fp16_t * data = (const ggml_fp16_t *) (src.data() + offs);
+            for (int64_t i = 0; i < n; ++i) {
+                w.put(ggml_fp32_to_bf16(ggml_fp16_to_fp32(data[i])));
+            }
+        } else {
+            w.put(src.data() + offs, size);
+        }
+
+        offs += size;
+    }
+
+    return dst;
+}
+
+// logits of the first decoding step: sot [+ language + transcribe] + no timestamps, on the first 30 s of the audio
+static bool test_first_logits(whisper_context * ctx, const std::vector<float> & pcm, int n_threads, std::vector<float> & logits) {
+    if (whisper_pcm_to_mel(ctx, pcm.data(), pcm.size(), n_threads) != 0 || whisper_encode(ctx, 0, n_threads) != 0) {
+        return false;
+    }
+
+    std::vector<whisper_token> tokens = { whisper_token_sot(ctx), };
+    if (whisper_is_multilingual(ctx)) {
+        tokens.push_back(whisper_token_lang(ctx, whisper_lang_id("en")));
+        tokens.push_back(whisper_token_transcribe(ctx));
+    }
+    tokens.push_back(whisper_token_not(ctx));
+
+    if (whisper_decode(ctx, tokens.data(), tokens.size(), 0, n_threads) != 0) {
+        return false;
+    }
+
+    const int n_vocab = whisper_n_vocab(ctx);
+    const float * data = whisper_get_logits(ctx) + (tokens.size() - 1)*n_vocab;
+
+    logits.assign(data, data + n_vocab);
+
+    return true;
+}
+
+static std::string test_transcribe(whisper_context * ctx, const std::vector<float> & pcm, int n_threads) {
+    whisper_full_params params = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
+
+    params.n_threads       = n_threads;
+    params.print_progress  = false;
+    params.print_realtime  = false;
+    params.no_context      = true;
+    params.temperature_inc = 0.0f;
+
+    std::string text;
+    if (whisper_full(ctx, params, pcm.data(), pcm.size()) != 0) {
+        return "<failed>";
+    }
+    for (int i = 0; i < whisper_full_n_segments(ctx); ++i) {
+        text += whisper_full_get_segment_text(ctx, i);
+    }
+
+    return text;
+}
+
+static void test_log_quiet(enum ggml_log_level level, const char * text, void *) {
+    if (level == GGML_LOG_LEVEL_ERROR) {
+        fputs(text, stderr);
+    }
+}
+
+int main(int argc, char ** argv) {
+    const bool real = argc > 1;
+    const int  n_threads = 4;
+
+    whisper_log_set(test_log_quiet, nullptr);
+
+    std::vector<uint8_t> model_f16;
+    if (real) {
+        std::ifstream fin(argv[1], std::ios::binary);
+        if (!fin) {
+            fprintf(stderr, "failed to open '%s'\n", argv[1]);
+            return 1;
+        }
+        model_f16.assign(std::istreambuf_iterator<char>(fin), std::istreambuf_iterator<char>());
+    } else {
+        model_f16 = test_model_random();
+    }
+
+    std::vector<uint8_t> model_bf16 = test_model_to_bf16(model_f16);
+    if (model_bf16.empty()) {
+        fprintf(stderr, "failed to convert the model to BF16\n");
+        return 1;
+    }
+
+    whisper_context_params cparams_f16 = whisper_context_default_params();
+    cparams_f16.use_gpu = false;
+
+    whisper_context_params cparams_bf16 = cparams_f16;
+    cparams_bf16.type_kv = GGML_TYPE_BF16;
+
+    whisper_context * ctx_f16  = whisper_init_from_buffer_with_params(model_f16.data(),  model_f16.size(),  cparams_f16);
+    whisper_context * ctx_bf16 = whisper_init_from_buffer_with_params(model_bf16.data(), model_bf16.size(), cparams_bf16);
+    if (!ctx_f16 || !ctx_bf16) {
+        fprintf(stderr, "failed to load the models\n");
+        return 1;
+    }
+
+    // 5 s at 440 Hz and an 8 s sweep 100 Hz -> 4 kHz
+    std::vector<std::pair<std::string, std::vector<float>>> inputs;
+    {
+        std::vector<float> pcm(5*TEST_SAMPLE_RATE);
+        for (size_t i = 0; i < pcm.size(); ++i) {
+            pcm[i] = 0.3f*sin((2.0*M_PI*440.0*i)/TEST_SAMPLE_RATE);
+        }
+        inputs.emplace_back("tone_440hz_5s", std::move(pcm));
+    }
+    {
+        const double f0 = 100.0;
+        const double f1 = 4000.0;
+        const double T  = 8.0;
+
+        std::vector<float> pcm(T*TEST_SAMPLE_RATE);
+        for (size_t i = 0; i < pcm.size(); ++i) {
+            const double t = (double) i/TEST_SAMPLE_RATE;
+            pcm[i] = 0.3f*sin(2.0*M_PI*(f0*t + 0.5*(f1 - f0)*t*t/T));
+        }
+        inputs.emplace_back("sweep_8s", std::move(pcm));
+    }
+
+    int n_fail = 0;
+
+    for (const auto & input : inputs) {
+        std::vector<float> logits_f16;
+        std::vector<float> logits_bf16;
+
+        if (!test_first_logits(ctx_f16, input.second, n_threads, logits_f16) || !test_first_logits(ctx_bf16, input.second, n_threads, logits_bf16)) {
+            fprintf(stderr, "%s: failed to compute the logits\n", input.first.c_str());
+            n_fail++;
+            continue;
+        }
+
+        float max_ref  = 0.0f;
+        float max_diff = 0.0f;
+        for (size_t i = 0; i < logits_f16.size(); ++i) {
+            max_ref  = std::max(max_ref,  std::fabs(logits_f16[i]));
+            max_diff = std::max(max_diff, std::fabs(logits_bf16[i] - logits_f16[i]));
+        }
+        const float rel = max_diff/std::max(max_ref, 1e-6f);
+
+        bool ok = rel <= TEST_BF16_TOLERANCE;
+
+        printf("%-16s max |dlogit| %6.3f (%5.2f%% of max |logit|, tolerance %.0f%%)", input.first.c_str(), max_diff, 100.0f*rel, 100.0f*TEST_BF16_TOLERANCE);
+
+        if (real) {
+            const std::string text_f16  = test_transcribe(ctx_f16,  input.second, n_threads);
+            const std::string text_bf16 = test_transcribe(ctx_bf16, input.second, n_threads);
+
+            ok = ok && text_f16 == text_bf16;
+
+            printf(", transcript %s", text_f16 == text_bf16 ? "same" : "differs");
+            if (text_f16 != text_bf16) {
+                printf(" ('%s' vs '%s')", text_f16.c_str(), text_bf16.c_str());
+            }
+        }
+
+        printf(": %s\n", ok ? "OK" : "FAILED");
+
+        n_fail += ok ? 0 : 1;
+    }
+
+    whisper_free(ctx_bf16);
+    whisper_free(ctx_f16);
+
+    return n_fail == 0 ? 0 : 1;
+}